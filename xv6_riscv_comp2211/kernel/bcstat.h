@@ -0,0 +1,22 @@
+// Buffer cache statistics (bio.c), for each region of the
+// disk, as laid out by the superblock.
+#define BC_LOG      0
+#define BC_INODE    1
+#define BC_BITMAP   2
+#define BC_DATA     3   // and the boot block and superblock
+#define BC_NREGION  4
+
+struct bcregion {
+  uint64 hits;       // lookups that found the block cached
+  uint64 misses;     // and that didn't
+  uint64 evictions;  // cached blocks whose buffer was recycled
+  uint64 reads;      // blocks read from disk
+  uint64 readtime;   // timer cycles they took, added up
+  uint64 writes;     // blocks written to disk
+  uint64 writetime;
+};
+
+struct bcstat {
+  char policy[8];    // replacement policy
+  struct bcregion r[BC_NREGION];
+};
@@ -1,18 +1,41 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
-// cached copies of disk block contents.  Caching disk blocks
+// The buffer cache is an array of buf structures, found by a
+// hash of their block numbers, holding cached copies of
+// disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
-// * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * To get a buffer for a particular disk block, call bread,
+//     or breadn to read the blocks after it as well.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bwritev to write several at once.
+// * To overwrite a whole block without reading it, call bnew.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
-
+//
+// Which buffer gets recycled for a block that isn't cached is up
+// to a replacement policy (struct bpolicy), chosen when the
+// kernel is built: BPOLICY=lru or BPOLICY=twoq (the default).
+// Plain LRU lets one pass over a big file push out everything
+// else, like the bitmap and inode blocks; 2Q keeps blocks used
+// only once in a FIFO of their own, and only moves a block to
+// its LRU list if it is asked for again after leaving the FIFO.
+//
+// The log marks a block dirty (bdirty) once the transaction that
+// changed it has committed, rather than writing it home at once.
+// The bflush thread writes dirty buffers back, in block order and
+// in batches, when they have been dirty for FLUSHAGE ticks or more
+// than DIRTYMAX are. bget() recycles clean buffers first, and
+// writes a dirty one back before reusing it.
+//
+// A dirty buffer that someone holds a reference to may also
+// hold uncommitted changes (log_write() pins it); only the
+// log's checkpoint, run while no FS system call is, writes
+// such a buffer (bsync).
 
 #include "types.h"
 #include "param.h"
@@ -22,34 +45,291 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "virtio.h"
+#include "bcstat.h"
+
+extern struct superblock sb;
+
+#ifndef BPOLICY
+#define BPOLICY twoq
+#endif
+
+// A replacement policy keeps the buffers on lists of its own,
+// through prev/next. Each function is called holding bcache.lock.
+struct bpolicy {
+  char *name;
+  void (*init)(void);
+  void (*hit)(struct buf *b);     // b's block was asked for, and is cached
+  void (*evict)(struct buf *b);   // b is about to cache another block
+  void (*fill)(struct buf *b);    // b now caches a new block
+  void (*put)(struct buf *b);     // b's last reference has gone
+  // an unreferenced buffer to recycle, a clean one if
+  // clean is set, or 0 if there is none.
+  struct buf *(*victim)(int clean);
+};
+
+#define NBHASH 64
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBHASH)
 
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
+  struct buf *hash[NBHASH];  // buffers by (dev, blockno)
+
+  int ndirty;           // dirty buffers
+  int flushwant;        // bdirty() wants bflush() to run now
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct bcregion stat[BC_NREGION];
 } bcache;
 
+#define FLUSHINT  10          // ticks between bflush() scans
+#define FLUSHAGE  30          // ticks a buffer stays dirty, at most
+#define DIRTYMAX  (NBUF / 4)  // dirty buffers before bflush() hurries
+#define NFLUSH    32          // buffers bflush() writes at once
+
+// The region of the disk block blockno lies in.
+static int
+bregion(uint blockno)
+{
+  if(sb.size == 0)
+    return BC_DATA;     // before fsinit() has read the superblock
+  if(blockno >= sb.logstart && blockno < sb.logstart + sb.nlog)
+    return BC_LOG;
+  if(blockno >= sb.inodestart && blockno < sb.bmapstart)
+    return BC_INODE;
+  if(blockno >= sb.bmapstart && blockno <= BBLOCK(sb.size - 1, sb))
+    return BC_BITMAP;
+  return BC_DATA;
+}
+
+// Doubly-linked lists of buffers, with a dummy head buffer.
+static void
+lhead(struct buf *h)
+{
+  h->prev = h;
+  h->next = h;
+}
+
+static void
+lpush(struct buf *h, struct buf *b)
+{
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+}
+
+static void
+lremove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Least recently put-back buffer on list h that could be
+// recycled, or 0.
+static struct buf*
+ltail(struct buf *h, int clean)
+{
+  struct buf *b;
+
+  for(b = h->prev; b != h; b = b->prev){
+    if(b->refcnt == 0 && !(clean && b->dirty))
+      return b;
+  }
+  return 0;
+}
+
+// LRU: one list, most recently used first.
+
+static struct buf lru;
+
+static void
+lruinit(void)
+{
+  struct buf *b;
+
+  lhead(&lru);
+  for(b = bcache.buf; b < bcache.buf+NBUF; b++)
+    lpush(&lru, b);
+}
+
+static void
+lrunop(struct buf *b)
+{
+}
+
+static void
+lruput(struct buf *b)
+{
+  lremove(b);
+  lpush(&lru, b);
+}
+
+static struct buf*
+lruvictim(int clean)
+{
+  return ltail(&lru, clean);
+}
+
+struct bpolicy lrupolicy = {
+  "lru", lruinit, lrunop, lrunop, lrunop, lruput, lruvictim,
+};
+
+// 2Q (Johnson and Shasha): a block not seen lately goes on
+// a1, a FIFO that hits don't reorder. Evicted from a1, the
+// block is remembered, without its data, on the ghost ring;
+// asked for again while remembered, it goes on am, an LRU
+// list. Buffers are taken from a1 while it holds more than
+// KIN of them, and from the tail of am otherwise.
+
+#define KIN     (NBUF / 4)
+#define NGHOST  (NBUF / 2)
+
+static struct {
+  struct buf a1;
+  struct buf am;
+  int na1;
+  struct {
+    uint dev;
+    uint blockno;
+  } ghost[NGHOST];
+  int gnext;             // oldest ghost, replaced next
+} twoq;
+
+static void
+twoqinit(void)
+{
+  struct buf *b;
+  int i;
+
+  lhead(&twoq.a1);
+  lhead(&twoq.am);
+  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
+    b->q = 0;
+    lpush(&twoq.a1, b);
+    twoq.na1++;
+  }
+  for(i = 0; i < NGHOST; i++)
+    twoq.ghost[i].blockno = ~0;
+}
+
+static void
+twoqhit(struct buf *b)
+{
+}
+
+static void
+twoqevict(struct buf *b)
+{
+  if(b->q == 0 && b->valid){
+    twoq.ghost[twoq.gnext].dev = b->dev;
+    twoq.ghost[twoq.gnext].blockno = b->blockno;
+    twoq.gnext = (twoq.gnext + 1) % NGHOST;
+  }
+}
+
+static void
+twoqfill(struct buf *b)
+{
+  int i;
+
+  lremove(b);
+  if(b->q == 0)
+    twoq.na1--;
+  for(i = 0; i < NGHOST; i++){
+    if(twoq.ghost[i].dev == b->dev && twoq.ghost[i].blockno == b->blockno){
+      twoq.ghost[i].blockno = ~0;
+      b->q = 1;
+      lpush(&twoq.am, b);
+      return;
+    }
+  }
+  b->q = 0;
+  lpush(&twoq.a1, b);
+  twoq.na1++;
+}
+
+static void
+twoqput(struct buf *b)
+{
+  if(b->q == 1){
+    lremove(b);
+    lpush(&twoq.am, b);
+  }
+}
+
+static struct buf*
+twoqvictim(int clean)
+{
+  struct buf *b;
+
+  if(twoq.na1 > KIN && (b = ltail(&twoq.a1, clean)) != 0)
+    return b;
+  if((b = ltail(&twoq.am, clean)) != 0)
+    return b;
+  return ltail(&twoq.a1, clean);
+}
+
+struct bpolicy twoqpolicy = {
+  "2q", twoqinit, twoqhit, twoqevict, twoqfill, twoqput, twoqvictim,
+};
+
+#define POLICY_(p) p##policy
+#define POLICY(p) POLICY_(p)
+static struct bpolicy *policy = &POLICY(BPOLICY);
+
 void
 binit(void)
 {
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
-
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->hnext = bcache.hash[BHASH(b->dev, b->blockno)];
+    bcache.hash[BHASH(b->dev, b->blockno)] = b;
   }
+  policy->init();
+}
+
+// The buffer caching block blockno of dev, or 0.
+// Caller holds bcache.lock.
+static struct buf*
+blookup(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bcache.hash[BHASH(dev, blockno)]; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  }
+  return 0;
+}
+
+// Give unreferenced buffer b to block blockno of dev, and lock
+// it. Caller holds bcache.lock, which this releases.
+static struct buf*
+bassign(struct buf *b, uint dev, uint blockno)
+{
+  struct buf **pp;
+
+  if(b->valid)
+    bcache.stat[bregion(b->blockno)].evictions++;
+  policy->evict(b);
+  for(pp = &bcache.hash[BHASH(b->dev, b->blockno)]; *pp != b; pp = &(*pp)->hnext)
+    ;
+  *pp = b->hnext;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->hnext = bcache.hash[BHASH(dev, blockno)];
+  bcache.hash[BHASH(dev, blockno)] = b;
+  b->valid = 0;
+  b->refcnt = 1;
+  policy->fill(b);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
@@ -61,33 +341,78 @@ bget(uint dev, uint blockno)
   struct buf *b;
 
   acquire(&bcache.lock);
+again:
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = blookup(dev, blockno)) != 0){
+    b->refcnt++;
+    bcache.stat[bregion(blockno)].hits++;
+    policy->hit(b);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Recycle the unused clean buffer the policy picks.
+  if((b = policy->victim(1)) != 0){
+    bcache.stat[bregion(blockno)].misses++;
+    return bassign(b, dev, blockno);
+  }
+
+  // Every unused buffer is dirty. Write the one the policy
+  // picks back, then look again: while we did, someone
+  // may have cached blockno.
+  if((b = policy->victim(0)) != 0){
+    // unreferenced, so unlocked: this doesn't sleep.
+    b->refcnt++;
+    acquiresleep(&b->lock);
+    release(&bcache.lock);
+    bwrite(b);
+    brelse(b);
+    acquire(&bcache.lock);
+    goto again;
   }
   panic("bget: no buffers");
 }
 
+// Has b been written home? Caller holds bcache.lock.
+static void
+bclean(struct buf *b)
+{
+  if(b->dirty){
+    b->dirty = 0;
+    bcache.ndirty--;
+  }
+}
+
+// Read or write the n locked buffers in bs, and count the
+// blocks and how long the disk took with them.
+static void
+bdisk(struct buf **bs, int n, int write)
+{
+  struct bcregion *r;
+  uint64 t;
+  int i;
+
+  t = r_time();
+  blkrw(bs, n, write);
+  t = r_time() - t;
+  acquire(&bcache.lock);
+  for(i = 0; i < n; i++){
+    r = &bcache.stat[bregion(bs[i]->blockno)];
+    if(write){
+      r->writes++;
+      r->writetime += t;
+      bclean(bs[i]);
+    } else {
+      r->reads++;
+      r->readtime += t;
+    }
+  }
+  release(&bcache.lock);
+}
+
 // Return a locked buf with the contents of the indicated block.
 struct buf*
 bread(uint dev, uint blockno)
@@ -96,23 +421,94 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    bdisk(&b, 1, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Return a locked buf for the indicated block if it isn't
+// cached and a buffer is free, for reading ahead, or 0.
+static struct buf*
+bgetra(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  acquire(&bcache.lock);
+  if(blookup(dev, blockno) == 0 && (b = policy->victim(1)) != 0)
+    return bassign(b, dev, blockno);
+  release(&bcache.lock);
+  return 0;
+}
+
+// Like bread, but if the block isn't cached, read the n-1
+// blocks after it too (readahead), in one disk request with
+// it, stopping at the first that is already cached.
+struct buf*
+breadn(uint dev, uint blockno, int n)
+{
+  struct buf *bs[MAXSEG];
+  int i, k;
+
+  bs[0] = bget(dev, blockno);
+  if(bs[0]->valid)
+    return bs[0];
+  if(n > MAXSEG)
+    n = MAXSEG;
+  for(k = 1; k < n; k++){
+    if((bs[k] = bgetra(dev, blockno + k)) == 0)
+      break;
+    if(bs[k]->valid){
+      // raced with another reader.
+      brelse(bs[k]);
+      break;
+    }
+  }
+  bdisk(bs, k, 0);
+  for(i = 0; i < k; i++)
+    bs[i]->valid = 1;
+  for(i = 1; i < k; i++)
+    brelse(bs[i]);
+  return bs[0];
+}
+
+// Return a locked buf for the indicated block, without
+// reading it: the caller will overwrite all of b->data.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  bdisk(&b, 1, 1);
+}
+
+// Write the n buffers in bs to disk as one batch, in no
+// particular order.  Each must be locked.
+void
+bwritev(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+  }
+  bdisk(bs, n, 1);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Tell the policy if no one else holds it.
 void
 brelse(struct buf *b)
 {
@@ -125,14 +521,8 @@ brelse(struct buf *b)
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
+    policy->put(b);
+  }
   release(&bcache.lock);
 }
 
@@ -150,4 +540,131 @@ bunpin(struct buf *b) {
   release(&bcache.lock);
 }
 
+// Mark locked buffer b, whose changes have committed, as
+// needing to be written home.
+void
+bdirty(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bdirty");
+  acquire(&bcache.lock);
+  if(!b->dirty){
+    b->dirty = 1;
+    b->dirtyat = ticks;
+    if(++bcache.ndirty > DIRTYMAX)
+      bcache.flushwant = 1;
+  }
+  release(&bcache.lock);
+}
+
+// Sort the n buffers in bs by block number.
+static void
+bsort(struct buf **bs, int n)
+{
+  struct buf *t;
+  int i, j;
+
+  for(i = 1; i < n; i++){
+    t = bs[i];
+    for(j = i; j > 0 && bs[j-1]->blockno > t->blockno; j--)
+      bs[j] = bs[j-1];
+    bs[j] = t;
+  }
+}
+
+// Write back those of the n blocks that are cached and dirty,
+// and wait. For the log's checkpoint: no FS system call may be
+// executing, so each holds only committed data.
+void
+bsync(uint dev, int *blocks, int n)
+{
+  struct buf *b, *bs[NFLUSH];
+  int i, k;
 
+  for(i = 0; i < n; ){
+    k = 0;
+    acquire(&bcache.lock);
+    for(; i < n && k < NFLUSH; i++){
+      if((b = blookup(dev, blocks[i])) != 0 && b->dirty){
+        b->refcnt++;
+        bs[k++] = b;
+      }
+    }
+    release(&bcache.lock);
+    bsort(bs, k);
+    for(int j = 0; j < k; j++)
+      acquiresleep(&bs[j]->lock);
+    bwritev(bs, k);
+    for(int j = 0; j < k; j++)
+      brelse(bs[j]);
+  }
+}
+
+// The flusher thread. Every FLUSHINT ticks, or sooner when
+// too many buffers are dirty, write back the buffers that have
+// been dirty too long, or all of them if there are too many,
+// NFLUSH at a time in block order.
+void
+bflush(void)
+{
+  struct buf *b, *bs[NFLUSH];
+  uint t0, now;
+  int i, k, force;
+
+  for(;;){
+    acquire(&tickslock);
+    t0 = ticks;
+    while(ticks - t0 < FLUSHINT && !bcache.flushwant)
+      sleep(&ticks, &tickslock);
+    now = ticks;
+    release(&tickslock);
+
+    do {
+      k = 0;
+      acquire(&bcache.lock);
+      bcache.flushwant = 0;
+      force = bcache.ndirty > DIRTYMAX;
+      for(b = bcache.buf; b < bcache.buf+NBUF && k < NFLUSH; b++){
+        if(b->dirty && b->refcnt == 0 && (force || now - b->dirtyat >= FLUSHAGE)){
+          // an unreferenced buffer is unlocked, so this
+          // doesn't sleep.
+          b->refcnt++;
+          acquiresleep(&b->lock);
+          bs[k++] = b;
+        }
+      }
+      release(&bcache.lock);
+
+      bsort(bs, k);
+      bwritev(bs, k);
+      for(i = 0; i < k; i++)
+        brelse(bs[i]);
+    } while(k == NFLUSH);
+  }
+}
+
+// Copy the cache's statistics to st.
+void
+bcstat(struct bcstat *st)
+{
+  acquire(&bcache.lock);
+  safestrcpy(st->policy, policy->name, sizeof(st->policy));
+  memmove(st->r, bcache.stat, sizeof(st->r));
+  release(&bcache.lock);
+}
+
+// Print the cache's hit rate on the console. For ^P.
+void
+bprint(void)
+{
+  uint64 hits = 0, misses = 0;
+  int i;
+
+  for(i = 0; i < BC_NREGION; i++){
+    hits += bcache.stat[i].hits;
+    misses += bcache.stat[i].misses;
+  }
+  printf("bcache %s: %d hits %d misses (%d%%)\n", policy->name,
+         (int)hits, (int)misses,
+         hits + misses ? (int)(hits * 100 / (hits + misses)) : 0);
+}
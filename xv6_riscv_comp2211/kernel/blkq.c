@@ -0,0 +1,285 @@
+// Block request queues.
+//
+// Sit between the buffer cache and the disk driver, one queue
+// for each virtqueue the driver uses, each with its own lock. A
+// hart puts its requests on queue cpuid() % nqueue, so harts
+// doing I/O at once mostly don't share a lock.
+//
+// Requests wait in a queue sorted by block number; the device
+// is given at most QDEPTH of a queue's requests at a time, in
+// elevator order (C-LOOK: upward from the last request
+// dispatched, then back to the lowest). While a request waits,
+// buffers for the blocks just before or after it join it
+// (merging), up to MAXSEG blocks, so the device sees fewer,
+// larger requests.
+//
+// A single-block request is usually one a process is waiting
+// on to carry on, like a log tail write or an inode read. For
+// up to POLLTIME timer cycles, its caller spins, looking for the
+// request to finish with interrupts from the device turned
+// off, before it sleeps.
+//
+// Interface:
+// * blkrw(bs, n, write) reads or writes n locked buffers and
+//     returns when all are done.
+// * blkintr() handles a disk interrupt.
+// * blkdone(q, bs, n) is called by the driver as requests finish.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "virtio.h"
+#include "blkstat.h"
+
+#define NBLKREQ 32
+
+// requests the device may hold at once from a queue; each
+// uses up to MAXSEG+2 of its virtqueue's descriptors.
+#define QDEPTH (NUM / (MAXSEG + 2))
+
+struct blkreq {
+  uint dev;
+  uint blockno;          // first block
+  int write;
+  int n;                 // blocks, one per buffer
+  struct buf *b[MAXSEG];
+  struct blkreq *next;   // queue, or free list
+};
+
+struct blkq {
+  struct spinlock lock;
+  int id;                // virtqueue
+  struct blkreq req[NBLKREQ];
+  struct blkreq *free;
+  struct blkreq *queue;  // sorted by dev, blockno
+  int inflight;          // requests the device holds
+  int polling;           // callers in blkpoll()
+  uint dev;              // elevator position: the block after
+  uint pos;              //   the last request dispatched
+  struct blkstat stat;
+} blkq[NVQ];
+
+static void blkdispatch(struct blkq*);
+
+void
+blkinit(void)
+{
+  struct blkq *q;
+  struct blkreq *r;
+
+  for(q = blkq; q < blkq+NVQ; q++){
+    initlock(&q->lock, "blkq");
+    q->id = q - blkq;
+    for(r = q->req; r < q->req+NBLKREQ; r++){
+      r->next = q->free;
+      q->free = r;
+    }
+  }
+}
+
+// Does request r come before block blockno of dev?
+static int
+before(struct blkreq *r, uint dev, uint blockno)
+{
+  return r->dev < dev || (r->dev == dev && r->blockno < blockno);
+}
+
+// Add b to q, merging it into a waiting request for an
+// adjacent block if there is one. Caller holds q->lock.
+static void
+blkadd(struct blkq *q, struct buf *b, int write)
+{
+  struct blkreq *r, **pp;
+  int i;
+
+  for(r = q->queue; r; r = r->next){
+    if(r->dev != b->dev || r->write != write || r->n == MAXSEG)
+      continue;
+    if(b->blockno == r->blockno + r->n){
+      r->b[r->n++] = b;
+      q->stat.merges++;
+      return;
+    }
+    if(b->blockno + 1 == r->blockno){
+      // stays in place: nothing lies between r's
+      // predecessor and b.
+      for(i = r->n; i > 0; i--)
+        r->b[i] = r->b[i-1];
+      r->b[0] = b;
+      r->n++;
+      r->blockno--;
+      q->stat.merges++;
+      return;
+    }
+  }
+
+  while(q->free == 0){
+    blkdispatch(q);
+    if(q->free == 0)
+      sleep(&q->free, &q->lock);
+  }
+  r = q->free;
+  q->free = r->next;
+  r->dev = b->dev;
+  r->blockno = b->blockno;
+  r->write = write;
+  r->n = 1;
+  r->b[0] = b;
+  for(pp = &q->queue; *pp && before(*pp, r->dev, r->blockno); pp = &(*pp)->next)
+    ;
+  r->next = *pp;
+  *pp = r;
+}
+
+// Hand q's waiting requests to the device, in elevator order,
+// until it holds QDEPTH. Caller holds q->lock.
+static void
+blkdispatch(struct blkq *q)
+{
+  struct blkreq *r, **pp;
+
+  while(q->queue && q->inflight < QDEPTH){
+    for(pp = &q->queue; *pp && before(*pp, q->dev, q->pos); pp = &(*pp)->next)
+      ;
+    if(*pp == 0)
+      pp = &q->queue;   // wrap around to the lowest
+    r = *pp;
+    *pp = r->next;
+
+    q->inflight++;
+    q->dev = r->dev;
+    q->pos = r->blockno + r->n;
+    q->stat.requests++;
+    q->stat.blocks += r->n;
+    virtio_disk_start(q->id, r->b, r->n, r->write);
+
+    r->next = q->free;
+    q->free = r;
+    wakeup(&q->free);
+  }
+}
+
+// Have all n buffers in bs been read or written?
+static int
+blkfinished(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(bs[i]->disk == 1)
+      return 0;
+  }
+  return 1;
+}
+
+// Spin for up to POLLTIME timer cycles until the n buffers in
+// bs are done, taking finished requests from q's virtqueue
+// ourselves. Caller holds q->lock.
+static void
+blkpoll(struct blkq *q, struct buf **bs, int n)
+{
+  uint64 end = r_time() + POLLTIME;
+
+  if(q->polling++ == 0)
+    virtio_disk_intrs(q->id, 0);
+  while(!blkfinished(bs, n) && r_time() < end){
+    // let other harts in.
+    release(&q->lock);
+    acquire(&q->lock);
+    virtio_disk_poll(q->id);
+    blkdispatch(q);
+    q->stat.polls++;
+  }
+  if(--q->polling == 0){
+    virtio_disk_intrs(q->id, 1);
+    // a request may have finished after the last look,
+    // and won't interrupt.
+    virtio_disk_poll(q->id);
+    blkdispatch(q);
+  }
+}
+
+// Read or write the n buffers in bs, which the caller has
+// locked, and wait until all are done.
+void
+blkrw(struct buf **bs, int n, int write)
+{
+  struct blkq *q;
+  int i;
+
+  push_off();
+  q = &blkq[cpuid() % virtio_disk_nqueue()];
+  pop_off();
+
+  acquire(&q->lock);
+  for(i = 0; i < n; i++){
+    bs[i]->disk = 1;
+    blkadd(q, bs[i], write);
+    q->stat.bufs++;
+  }
+  blkdispatch(q);
+  if(POLLTIME > 0 && n == 1)
+    blkpoll(q, bs, n);
+  for(i = 0; i < n; i++){
+    while(bs[i]->disk == 1)
+      sleep(bs[i], &q->lock);
+  }
+  release(&q->lock);
+}
+
+// The driver has finished a request from queue qi for the n
+// buffers in bs. Called from virtio_disk_poll(), holding
+// that queue's lock.
+void
+blkdone(int qi, struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    bs[i]->disk = 0;   // disk is done with buf
+    wakeup(bs[i]);
+  }
+  blkq[qi].inflight--;
+}
+
+// The disk interrupted; it doesn't say which virtqueue
+// it finished requests on.
+void
+blkintr(void)
+{
+  struct blkq *q;
+
+  virtio_disk_intr();
+  for(q = blkq; q < blkq+virtio_disk_nqueue(); q++){
+    acquire(&q->lock);
+    if(q == blkq)
+      q->stat.intrs++;
+    virtio_disk_poll(q->id);
+    blkdispatch(q);
+    release(&q->lock);
+  }
+}
+
+// Add up the queues' statistics in st.
+void
+blkstat(struct blkstat *st)
+{
+  struct blkq *q;
+
+  memset(st, 0, sizeof(*st));
+  for(q = blkq; q < blkq+NVQ; q++){
+    acquire(&q->lock);
+    st->bufs += q->stat.bufs;
+    st->merges += q->stat.merges;
+    st->requests += q->stat.requests;
+    st->blocks += q->stat.blocks;
+    st->polls += q->stat.polls;
+    st->intrs += q->stat.intrs;
+    release(&q->lock);
+  }
+}
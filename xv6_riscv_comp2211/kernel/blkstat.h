@@ -0,0 +1,9 @@
+// Block request queue statistics (blkq.c).
+struct blkstat {
+  uint64 bufs;      // buffers read or written
+  uint64 merges;    // buffers that joined a waiting request
+  uint64 requests;  // requests given to the device
+  uint64 blocks;    // blocks in those requests
+  uint64 polls;     // looks at the device while polling
+  uint64 intrs;     // disk interrupts
+};
@@ -1,12 +1,16 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int dirty;   // holds committed data not yet written home?
+  uint dirtyat; // ticks when it became dirty
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int q;        // which replacement policy list (bio.c)
+  struct buf *prev; // replacement policy list
   struct buf *next;
+  struct buf *hnext; // bcache hash chain
   uchar data[BSIZE];
 };
 
@@ -0,0 +1,172 @@
+// Directory entry cache.
+//
+// Remembers the results of dirlookup(): which inode a name in
+// a directory refers to, or that the name isn't there (a
+// negative entry, with inum 0). A hit lets dirlookup() skip
+// reading the directory's blocks.
+//
+// Entries are keyed by (dev, directory inum, name). Callers
+// hold the directory's sleep-lock, which is what keeps an
+// entry in step with the directory: dirlink() and unlink()
+// update the entry for the name they change while holding
+// it. When an inode is freed, dcacheforget() drops entries
+// in it (or naming it), since its inum may be reused.
+//
+// Interface:
+// * dcachelookup(dev, dir, name, &inum) returns 1 on a hit.
+// * dcacheenter(dev, dir, name, inum) records a result.
+// * dcacheforget(dev, inum) drops entries for a freed inode.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+
+#define NDCACHE 128
+#define NDHASH  64
+
+struct dentry {
+  uint dev;
+  uint dir;               // inum of the directory; 0 if unused
+  char name[DIRSIZ];
+  uint inum;              // inum name refers to, or 0 if absent
+  struct dentry *hnext;   // hash chain
+  struct dentry *prev;    // LRU list
+  struct dentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDCACHE];
+  struct dentry *hash[NDHASH];
+
+  // Linked list of all entries, through prev/next.
+  // head.next is the most recently used.
+  struct dentry head;
+} dcache;
+
+static uint
+dhash(uint dev, uint dir, char *name)
+{
+  uint h = dev * 31 + dir;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+void
+dcacheinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.head.prev = &dcache.head;
+  dcache.head.next = &dcache.head;
+  for(d = dcache.dentry; d < dcache.dentry+NDCACHE; d++){
+    d->next = dcache.head.next;
+    d->prev = &dcache.head;
+    dcache.head.next->prev = d;
+    dcache.head.next = d;
+  }
+}
+
+// Find the entry for name in dir. Caller holds dcache.lock.
+static struct dentry*
+dfind(uint dev, uint dir, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dev, dir, name)]; d; d = d->hnext)
+    if(d->dev == dev && d->dir == dir && strncmp(d->name, name, DIRSIZ) == 0)
+      return d;
+  return 0;
+}
+
+// Move d to the front of the LRU list.
+static void
+dtouch(struct dentry *d)
+{
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  d->next = dcache.head.next;
+  d->prev = &dcache.head;
+  dcache.head.next->prev = d;
+  dcache.head.next = d;
+}
+
+// Take d off its hash chain and mark it unused.
+static void
+dunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  if(d->dir == 0)
+    return;
+  for(pp = &dcache.hash[dhash(d->dev, d->dir, d->name)]; *pp != d; pp = &(*pp)->hnext)
+    ;
+  *pp = d->hnext;
+  d->dir = 0;
+}
+
+// Look up name in directory dir. On a hit, set *inum to the
+// inode it names, or 0 if it is known to be absent, and
+// return 1. Return 0 on a miss.
+int
+dcachelookup(uint dev, uint dir, char *name, uint *inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dev, dir, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  dtouch(d);
+  *inum = d->inum;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dir refers to inum,
+// or is absent if inum is 0.
+void
+dcacheenter(uint dev, uint dir, char *name, uint inum)
+{
+  struct dentry *d;
+  uint h;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dev, dir, name)) == 0){
+    // recycle the least recently used entry.
+    d = dcache.head.prev;
+    dunhash(d);
+    d->dev = dev;
+    d->dir = dir;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(dev, dir, name);
+    d->hnext = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  d->inum = inum;
+  dtouch(d);
+  release(&dcache.lock);
+}
+
+// Inode inum on dev has been freed: forget the names in
+// it, if it was a directory, and any names for it.
+void
+dcacheforget(uint dev, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < dcache.dentry+NDCACHE; d++){
+    if(d->dir != 0 && d->dev == dev && (d->dir == inum || d->inum == inum))
+      dunhash(d);
+  }
+  release(&dcache.lock);
+}
@@ -1,3 +1,5 @@
+struct blkstat;
+struct bcstat;
 struct buf;
 struct context;
 struct file;
@@ -5,25 +7,49 @@ struct inode;
 struct pipe;
 struct proc;
 struct spinlock;
+struct shm;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     breadn(uint, uint, int);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+struct buf*     bnew(uint, uint);
+void            bdirty(struct buf*);
+void            bsync(uint, int*, int);
+void            bflush(void);
+void            bprint(void);
+void            bcstat(struct bcstat*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
+// blkq.c
+void            blkinit(void);
+void            blkrw(struct buf**, int, int);
+void            blkdone(int, struct buf**, int);
+void            blkintr(void);
+void            blkstat(struct blkstat*);
+
 // console.c
 void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// dcache.c
+void            dcacheinit(void);
+int             dcachelookup(uint, uint, char*, uint*);
+void            dcacheenter(uint, uint, char*, uint);
+void            dcacheforget(uint, uint);
+
 // exec.c
 int             exec(char*, char**);
+int             execinto(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -32,6 +58,7 @@ struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
+int             fileruns(struct file*);
 int             filewrite(struct file*, uint64, int n);
 
 // fs.c
@@ -51,24 +78,45 @@ struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
+int             iruns(struct inode*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+void            iflush(struct inode*);
 
 // ramdisk.c
 void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, int);
+int             futexwake(uint64, int);
+
 // kalloc.c
 void*           kalloc(void);
+void            kdup(void *);
 void            kfree(void *);
 void            kinit(void);
+void*           superalloc(void);
+void            superfree(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
-void            begin_op(void);
+void            begin_op(int);
 void            end_op(void);
+int             log_opmax(void);
+
+// mmap.c
+uint64          mmap(uint64, uint64, int, int, struct file*, uint64);
+int             munmap(uint64, uint64);
+void            munmapall(struct proc*);
+int             mmapcopy(struct proc*, struct proc*);
+int             mmapfault(pagetable_t, uint64, int);
+void            mmapprefault(uint64, int, int);
+uint64          mmapbase(struct proc*);
+struct vma*     vmaalloc(struct proc*, uint64);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -86,6 +134,10 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
+int             clone(uint64, uint64, uint64, uint64);
+int             join(uint64);
+int             nthreads(struct proc*);
+int             spawn(char*, char**, int*, int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -106,6 +158,7 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+int             kthread(void (*)(void), char*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -124,6 +177,14 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// shm.c
+void            shminit(void);
+int             shmget(int, uint64);
+uint64          shmat(int);
+int             shmdt(uint64);
+void            shmdup(struct shm*);
+void            shmput(struct shm*);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -166,9 +227,11 @@ uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
-void            uvmclear(pagetable_t, uint64);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmclear(pagetable_t, uint64);
+int             uvmsplit(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walklevel(pagetable_t, uint64, int, int, int*);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -182,7 +245,10 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_nqueue(void);
+void            virtio_disk_start(int, struct buf **, int, int);
+void            virtio_disk_intrs(int, int);
+void            virtio_disk_poll(int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -21,6 +21,22 @@ int flags2perm(int flags)
 
 int
 exec(char *path, char **argv)
+{
+  struct proc *p = myproc();
+
+  // the other threads would be left running in the old image.
+  if(nthreads(p) > 1)
+    return -1;
+
+  return execinto(p, path, argv);
+}
+
+// Replace the user memory of p with the program at path, and
+// set it up to start at main(argc, argv). p is either the
+// current process or, for spawn(), a new one that hasn't run.
+// Returns argc, or -1 if p is unchanged because of an error.
+int
+execinto(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
   int i, off;
@@ -29,9 +45,8 @@ exec(char *path, char **argv)
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
-  begin_op();
+  begin_op(IPUTBLOCKS);
 
   if((ip = namei(path)) == 0){
     end_op();
@@ -72,7 +87,6 @@ exec(char *path, char **argv)
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
@@ -83,7 +97,8 @@ exec(char *path, char **argv)
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0)
     goto bad;
   sz = sz1;
-  uvmclear(pagetable, sz-2*PGSIZE);
+  if(uvmclear(pagetable, sz-2*PGSIZE) < 0)
+    goto bad;
   sp = sz;
   stackbase = sp - PGSIZE;
 
@@ -121,6 +136,7 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  munmapall(p);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
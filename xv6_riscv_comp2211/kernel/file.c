@@ -76,7 +76,16 @@ fileclose(struct file *f)
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    if(ff.type == FD_INODE && ff.writable){
+      // write out delayed blocks (see idelay() in fs.c)
+      // before iput() might drop the last reference.
+      begin_op(IPUTBLOCKS);
+      ilock(ff.ip);
+      iflush(ff.ip);
+      iunlock(ff.ip);
+      end_op();
+    }
+    begin_op(IPUTBLOCKS);
     iput(ff.ip);
     end_op();
   }
@@ -101,6 +110,20 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Number of runs of contiguous disk blocks file f occupies.
+int
+fileruns(struct file *f)
+{
+  int r;
+
+  if(f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  r = iruns(f->ip);
+  iunlock(f->ip);
+  return r;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -118,10 +141,13 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    mmapprefault(addr, n, 1);
+    myproc()->nofilefault = 1;
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
+    myproc()->nofilefault = 0;
   } else {
     panic("fileread");
   }
@@ -146,20 +172,25 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write a few blocks at a time, each piece in its own
+    // transaction, reserving log space for each block and
+    // an allocation (bitmap or extent block) for it, plus
+    // the i-node, indirect blocks and a delayed-write flush.
+    // pieces end on block boundaries, so an unaligned write
+    // doesn't touch an extra block.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int kmax = (log_opmax() - IPUTBLOCKS) / 2;
     int i = 0;
+    mmapprefault(addr, n, 0);
+    myproc()->nofilefault = 1;
     while(i < n){
       int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
+      if(n1 > kmax*BSIZE - f->off%BSIZE)
+        n1 = kmax*BSIZE - f->off%BSIZE;
+      int k = (f->off%BSIZE + n1 + BSIZE - 1) / BSIZE;
 
-      begin_op();
+      begin_op(2*k + IPUTBLOCKS);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -172,6 +203,7 @@ filewrite(struct file *f, uint64 addr, int n)
       }
       i += r;
     }
+    myproc()->nofilefault = 0;
     ret = (i == n ? n : -1);
   } else {
     panic("filewrite");
@@ -18,6 +18,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // itable hash chain
+  struct inode *lprev; // itable LRU list, while ref is 0
+  struct inode *lnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +29,18 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint flags;
+  uint addrs[NADDRS];
+
+  uint mapbn;         // bmap() cache: blocks mapbn..mapbn+maplen-1
+  uint mapaddr;       // are at disk blocks mapaddr..
+  uint maplen;
+  uint goal;          // where bmap() next tries to allocate
+
+  char *dadata;       // delayed writes, or 0
+  uint dabn;          // block number of dadata's first block
+  uint dan;           // number of blocks in dadata
+  uint dares;         // free blocks reserved for them
 };
 
 // map major device number to device functions.
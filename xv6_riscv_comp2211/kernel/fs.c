@@ -37,6 +37,8 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bsuminit(int dev);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +46,9 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
+  if(kthread(bflush, "bflush") < 0)
+    panic("fsinit: bflush");
 }
 
 // Zero a block.
@@ -60,33 +65,233 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
-static uint
-balloc(uint dev)
+// Free-space summary: the number of free blocks in each group
+// of gsize blocks, counted from the bitmap at boot (after log
+// recovery) and kept up to date by balloc() and bfree(), so
+// that searches can skip groups with nothing to offer without
+// reading their part of the bitmap.
+//
+// It also tracks blocks reserved for delayed writes (see
+// idelay()), which balloc() leaves alone until they are
+// claimed.
+struct {
+  struct spinlock lock;
+  uint gsize;         // blocks per group, a multiple of 8
+  uint ngroups;
+  ushort *nfree;      // one page of counts
+  uint total;         // free blocks
+  uint reserved;      // free blocks promised to delayed writes
+} bsum;
+
+// Free blocks that delayed writes leave for the extent and
+// indirect blocks, and the directories, that will need them.
+#define DASLACK 8
+
+static void
+bsuminit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b;
+
+  initlock(&bsum.lock, "bsum");
+  bsum.gsize = 64;
+  while((sb.size + bsum.gsize - 1) / bsum.gsize > PGSIZE / sizeof(ushort))
+    bsum.gsize *= 2;
+  bsum.ngroups = (sb.size + bsum.gsize - 1) / bsum.gsize;
+  if((bsum.nfree = kalloc()) == 0)
+    panic("bsuminit");
+  memset(bsum.nfree, 0, PGSIZE);
 
   bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
+  for(b = 0; b < sb.size; b++){
+    if(bp == 0 || bp->blockno != BBLOCK(b, sb)){
+      if(bp)
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+      bp = bread(dev, BBLOCK(b, sb));
+    }
+    if((bp->data[(b % BPB) / 8] & (1 << (b % 8))) == 0){
+      bsum.nfree[b / bsum.gsize]++;
+      bsum.total++;
     }
+  }
+  if(bp)
     brelse(bp);
+}
+
+// Number of free blocks in the group holding block b.
+static uint
+bsumfree(uint b)
+{
+  uint n;
+
+  acquire(&bsum.lock);
+  n = bsum.nfree[b / bsum.gsize];
+  release(&bsum.lock);
+  return n;
+}
+
+// Number of blocks from b to the end of its group, or to
+// wrap, whichever comes first.
+static uint
+bsumskip(uint b, uint wrap)
+{
+  uint end;
+
+  end = (b / bsum.gsize + 1) * bsum.gsize;
+  if(end > wrap)
+    end = wrap;
+  return end - b;
+}
+
+// n blocks have been freed (or, if n < 0, allocated)
+// in the group holding block b.
+static void
+bsumadd(uint b, int n)
+{
+  acquire(&bsum.lock);
+  bsum.nfree[b / bsum.gsize] += n;
+  bsum.total += n;
+  release(&bsum.lock);
+}
+
+// Set aside n free blocks for delayed writes. Fails
+// (returning -1) if that would leave fewer than DASLACK
+// unreserved.
+static int
+bsumreserve(uint n)
+{
+  acquire(&bsum.lock);
+  if(bsum.total < bsum.reserved + n + DASLACK){
+    release(&bsum.lock);
+    return -1;
   }
-  printf("balloc: out of blocks\n");
+  bsum.reserved += n;
+  release(&bsum.lock);
   return 0;
 }
 
+static void
+bsumunreserve(uint n)
+{
+  acquire(&bsum.lock);
+  if(bsum.reserved < n)
+    panic("bsumunreserve");
+  bsum.reserved -= n;
+  release(&bsum.lock);
+}
+
+// Read the bitmap block holding block b's bit into *bpp,
+// unless it is already there, and return a pointer to the
+// byte holding the bit.
+static uchar*
+bbyte(uint dev, uint b, struct buf **bpp)
+{
+  if(*bpp == 0 || (*bpp)->blockno != BBLOCK(b, sb)){
+    if(*bpp)
+      brelse(*bpp);
+    *bpp = bread(dev, BBLOCK(b, sb));
+  }
+  return &(*bpp)->data[(b % BPB) / 8];
+}
+
+// Allocate up to *n contiguous zeroed disk blocks, and set
+// *n to the number allocated, which is at least one.
+// Blocks go at goal if it is free; otherwise at the start of
+// the next run of 8 free blocks, so that files being written
+// at the same time don't end up interleaved block by block;
+// otherwise at any free block. Both searches pass over groups
+// the summary says are too full. Returns the first block.
+// Blocks reserved for delayed writes are left alone, except
+// for the *res of them reserved by the caller, which are used
+// first and taken off *res. res may be 0.
+// returns 0 if out of disk space.
+static uint
+balloc(uint dev, uint goal, uint *n, uint *res)
+{
+  uint b, k, got, want, mine;
+  uchar *p;
+  struct buf *bp;
+
+  // claim the blocks, so that no one else counts on them
+  // while we look for them.
+  acquire(&bsum.lock);
+  mine = res ? *res : 0;
+  k = bsum.total > bsum.reserved ? bsum.total - bsum.reserved : 0;
+  if(*n > k + mine)
+    *n = k + mine;
+  if(mine > *n)
+    mine = *n;
+  want = *n;
+  bsum.reserved += want - mine;
+  if(res)
+    *res -= mine;
+  release(&bsum.lock);
+  got = 0;
+  if(want == 0)
+    goto out;
+
+  if(goal >= sb.size)
+    goal = 0;
+  bp = 0;
+  b = goal;
+  if(bsumfree(b) > 0 && (*bbyte(dev, b, &bp) & (1 << (b % 8))) == 0)
+    goto found;
+  for(k = 0; k < sb.size; k += 8){
+    b = ((goal + 7) / 8 * 8 + k) % (sb.size / 8 * 8);
+    if(bsumfree(b) < 8){
+      k += bsumskip(b, sb.size / 8 * 8) - 8;
+      continue;
+    }
+    if(b + 8 <= sb.size && *bbyte(dev, b, &bp) == 0)
+      goto found;
+  }
+  for(k = 0; k < sb.size; k++){
+    b = (goal + k) % sb.size;
+    if(bsumfree(b) == 0){
+      k += bsumskip(b, sb.size) - 1;
+      continue;
+    }
+    if((*bbyte(dev, b, &bp) & (1 << (b % 8))) == 0)
+      goto found;
+  }
+  if(bp)
+    brelse(bp);
+  goto out;
+
+ found:
+  // take as much of the free run as was asked for,
+  // within this bitmap block.
+  for(got = 0; got < *n && b + got < sb.size; got++){
+    if(got > 0 && (b + got) % BPB == 0)
+      break;
+    p = bbyte(dev, b + got, &bp);
+    if(*p & (1 << ((b + got) % 8)))
+      break;
+    *p |= 1 << ((b + got) % 8);  // Mark block in use.
+    bsumadd(b + got, -1);
+  }
+  log_write(bp);
+  brelse(bp);
+  for(k = 0; k < got; k++)
+    bzero(dev, b + k);
+
+ out:
+  // drop the claim; what wasn't allocated goes back to the
+  // caller's reservation first.
+  k = want - got < mine ? want - got : mine;
+  acquire(&bsum.lock);
+  bsum.reserved -= want - k;
+  release(&bsum.lock);
+  if(res)
+    *res += k;
+  if(got == 0){
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  *n = got;
+  return b;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -100,10 +305,19 @@ bfree(int dev, uint b)
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  bsumadd(b, 1);
   log_write(bp);
   brelse(bp);
 }
 
+// Free n blocks starting at b.
+static void
+bfreerange(int dev, uint b, uint n)
+{
+  while(n-- > 0)
+    bfree(dev, b++);
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -129,18 +343,21 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to the entry (open files and current
+//   directories). iget() finds or creates a table entry and
+//   increments its ref; iput() decrements ref. An entry with
+//   ip->ref zero goes on an LRU list but keeps its contents,
+//   so a later iget() of the same inode needn't read the
+//   disk; iget() recycles the least recently used entry
+//   once the table holds NINODE entries, and allocates
+//   more if all of them are referenced.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid if it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -165,31 +382,76 @@ bfree(int dev, uint b)
 // multi-step atomic operations.
 //
 // The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
+// entries. Since ip->ref indicates whether an entry is in use,
 // and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// holds, one must hold itable.lock while using any of those
+// fields, or the hash and LRU links.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 64
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH]; // entries by (dev, inum)
+  struct inode lru;   // head of unreferenced entries, most recent first
+  int n;              // entries allocated
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.lru.lprev = &itable.lru;
+  itable.lru.lnext = &itable.lru;
+}
+
+// Put ip on the LRU list, at the front if front is set,
+// otherwise at the back to be recycled first.
+// Caller must hold itable.lock.
+static void
+lruinsert(struct inode *ip, int front)
+{
+  struct inode *prev = front ? &itable.lru : itable.lru.lprev;
+
+  ip->lprev = prev;
+  ip->lnext = prev->lnext;
+  prev->lnext->lprev = ip;
+  prev->lnext = ip;
+}
+
+static void
+lruremove(struct inode *ip)
+{
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev = ip->lnext = 0;
+}
+
+// Add a page of unused entries to the table.
+// Caller must hold itable.lock. Returns 0 if out of memory.
+static int
+igrow(void)
+{
+  struct inode *ip;
+  char *mem;
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  for(ip = (struct inode*)mem; ip + 1 <= (struct inode*)(mem + PGSIZE); ip++){
+    initsleeplock(&ip->lock, "inode");
+    lruinsert(ip, 0);
+    itable.n++;
   }
+  return 1;
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void idiscard(struct inode *ip);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -208,6 +470,10 @@ ialloc(uint dev, short type)
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      if(type == T_FILE)
+        dip->flags = IEXTENT | IINLINE;
+      else if(type != T_DEVICE)
+        dip->flags = IEXTENT;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
@@ -235,6 +501,9 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
+  if(ip->dan > 0 && dip->size > ip->dabn * BSIZE)
+    dip->size = ip->dabn * BSIZE;  // only what has blocks
+  dip->flags = ip->flags;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
@@ -246,31 +515,45 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = itable.hash[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref == 0)
+        lruremove(ip);
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Take the least recently used entry, after growing
+  // the table if it is still small or if every entry is
+  // in use. Unused entries have inum 0.
+  ip = itable.lru.lprev;
+  if(ip == &itable.lru || (ip->inum != 0 && itable.n < NINODE)){
+    igrow();
+    ip = itable.lru.lprev;
+  }
+  if(ip == &itable.lru)
     panic("iget: no inodes");
+  lruremove(ip);
 
-  ip = empty;
+  // Recycle it.
+  if(ip->inum != 0){
+    for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = itable.hash[IHASH(dev, inum)];
+  itable.hash[IHASH(dev, inum)] = ip;
   release(&itable.lock);
 
   return ip;
@@ -308,7 +591,10 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
+    ip->flags = dip->flags;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->maplen = 0;
+    ip->goal = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -328,7 +614,8 @@ iunlock(struct inode *ip)
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled, though it stays cached until it is, and any
+// delayed writes go to disk.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -351,13 +638,23 @@ iput(struct inode *ip)
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    dcacheforget(ip->dev, ip->inum);
 
     releasesleep(&ip->lock);
 
     acquire(&itable.lock);
+  } else if(ip->ref == 1 && ip->valid && ip->dan > 0){
+    // fileclose() flushes delayed writes, in a transaction
+    // of their own, before it lets go of the file.
+    panic("iput: delayed writes");
   }
 
   ip->ref--;
+  if(ip->ref == 0){
+    // keep the contents of a live inode; an entry whose
+    // inode was just freed is the first to be recycled.
+    lruinsert(ip, ip->valid);
+  }
   release(&itable.lock);
 }
 
@@ -372,54 +669,217 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk, except that a regular file of at
+// most NINLINE bytes keeps its data in ip->addrs[] itself
+// (IINLINE), costing no blocks at all, until writei() moves
+// it to a block. Inodes made by ialloc() (other than
+// devices) are extent-mapped: ip->addrs[] holds a list of
+// extents, each a run of contiguous blocks, and new blocks
+// are allocated next to the end of the last extent where
+// possible, so a file written sequentially usually occupies
+// a few long runs. Otherwise, as in inodes written by older
+// kernels, the first NDIRECT block numbers are listed in
+// ip->addrs[], the next NINDIRECT blocks are listed in
+// block ip->addrs[NDIRECT], and the next NDINDIRECT and
+// NTINDIRECT in trees of indirect blocks two and three
+// deep, rooted at ip->addrs[NDIRECT+1] and [NDIRECT+2].
+//
+// bmap() remembers the last run of contiguous blocks it
+// found in ip->mapbn, mapaddr and maplen, so reading or
+// writing a file sequentially mostly skips the extent and
+// indirect blocks.
+
+// Return the disk block address of the nth block in
+// extent-mapped inode ip. If there is no such block,
+// allocate blocks up to it and want-1 more, contiguous
+// if possible, as the caller is about to write them.
+// returns 0 if out of disk space or out of extents.
+static uint
+emap(struct inode *ip, uint bn, uint want)
+{
+  struct extent *e, *last;
+  struct buf *bp;
+  uint lbn, addr, n, one;
+  int i;
+
+  for(;;){
+    // find bn, or the end of the list.
+    bp = 0;
+    last = 0;
+    lbn = 0;
+    e = (struct extent*)ip->addrs;
+    for(i = 0; i < NIEXTENT + NEXTENT; i++, e++){
+      if(i == NIEXTENT){
+        if(ip->addrs[EXTBLOCK] == 0)
+          break;
+        bp = bread(ip->dev, ip->addrs[EXTBLOCK]);
+        e = (struct extent*)bp->data;
+      }
+      if(e->len == 0)
+        break;
+      if(bn < lbn + e->len){
+        ip->mapbn = lbn;
+        ip->mapaddr = e->start;
+        ip->maplen = e->len;
+        addr = e->start + (bn - lbn);
+        if(bp)
+          brelse(bp);
+        return addr;
+      }
+      lbn += e->len;
+      last = e;
+    }
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+    // bn is past the end: grow the last extent,
+    // or start a new one.
+    n = bn - lbn + want;
+    addr = balloc(ip->dev, last ? last->start + last->len : ip->goal, &n, &ip->dares);
+    if(addr == 0)
+      goto bad;
+    ip->goal = addr + n;
+    if(last && addr == last->start + last->len){
+      last->len += n;
+    } else {
+      if(i == NIEXTENT + NEXTENT){
+        bfreerange(ip->dev, addr, n);
+        goto bad;
+      }
+      if(i == NIEXTENT && bp == 0){
+        one = 1;
+        if((ip->addrs[EXTBLOCK] = balloc(ip->dev, addr + n, &one, &ip->dares)) == 0){
+          bfreerange(ip->dev, addr, n);
+          goto bad;
+        }
+        bp = bread(ip->dev, ip->addrs[EXTBLOCK]);
+        e = (struct extent*)bp->data;
+      }
+      e->start = addr;
+      e->len = n;
+    }
+    if(bp){
+      log_write(bp);
+      brelse(bp);
+    }
+  }
+
+ bad:
+  if(bp)
+    brelse(bp);
+  return 0;
+}
+
+// Return the disk block address of block ib of the tree of
+// indirect blocks depth deep whose root address is in *root,
+// allocating blocks as necessary. lbn is ib's logical block
+// number in ip, for the cache.
 // returns 0 if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+imap(struct inode *ip, uint *root, int depth, uint ib, uint lbn)
 {
-  uint addr, *a;
+  uint addr, i, j, span, one, *a;
   struct buf *bp;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
+  one = 1;
+  if((addr = *root) == 0){
+    if((addr = balloc(ip->dev, ip->goal, &one, 0)) == 0)
+      return 0;
+    ip->goal = addr + 1;
+    *root = addr;
+  }
+  for(span = 1, i = 1; i < depth; i++)
+    span *= NINDIRECT;
+  for(; depth > 0; depth--, span /= NINDIRECT){
+    bp = bread(ip->dev, addr);
+    a = (uint*)bp->data;
+    i = ib / span % NINDIRECT;
+    if((addr = a[i]) == 0){
+      one = 1;
+      if((addr = balloc(ip->dev, ip->goal, &one, 0)) == 0){
+        brelse(bp);
         return 0;
-      ip->addrs[bn] = addr;
+      }
+      ip->goal = addr + 1;
+      a[i] = addr;
+      log_write(bp);
     }
-    return addr;
+    if(depth == 1){
+      // remember the run of contiguous blocks from here.
+      for(j = i + 1; j < NINDIRECT && a[j] == addr + (j - i); j++)
+        ;
+      ip->mapbn = lbn;
+      ip->mapaddr = addr;
+      ip->maplen = j - i;
+    }
+    brelse(bp);
   }
-  bn -= NDIRECT;
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one, along with
+// want-1 following blocks if the inode is extent-mapped.
+// returns 0 if out of disk space.
+static uint
+bmap(struct inode *ip, uint bn, uint want)
+{
+  uint addr, ib, one;
+
+  if(bn - ip->mapbn < ip->maplen)
+    return ip->mapaddr + (bn - ip->mapbn);
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+  if(ip->flags & IEXTENT)
+    return emap(ip, bn, want);
+
+  one = 1;
+  if(bn < NDIRECT){
+    if((addr = ip->addrs[bn]) == 0){
+      addr = balloc(ip->dev, ip->goal, &one, 0);
       if(addr == 0)
         return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
-      }
+      ip->goal = addr + 1;
+      ip->addrs[bn] = addr;
     }
-    brelse(bp);
     return addr;
   }
+  ib = bn - NDIRECT;
+
+  if(ib < NINDIRECT)
+    return imap(ip, &ip->addrs[NDIRECT], 1, ib, bn);
+  ib -= NINDIRECT;
+
+  if(ib < NDINDIRECT)
+    return imap(ip, &ip->addrs[NDIRECT+1], 2, ib, bn);
+  ib -= NDINDIRECT;
+
+  if(ib < NTINDIRECT)
+    return imap(ip, &ip->addrs[NDIRECT+2], 3, ib, bn);
 
   panic("bmap: out of range");
 }
 
+// Free the tree of indirect blocks depth deep rooted at
+// block addr, and the blocks it lists.
+static void
+ifree(int dev, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 1)
+      ifree(dev, a[j], depth - 1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -427,7 +887,35 @@ itrunc(struct inode *ip)
 {
   int i, j;
   struct buf *bp;
-  uint *a;
+  struct extent *e;
+
+  idiscard(ip);
+  if(ip->flags & IINLINE){
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
+  if(ip->flags & IEXTENT){
+    e = (struct extent*)ip->addrs;
+    for(i = 0; i < NIEXTENT && e[i].len; i++)
+      bfreerange(ip->dev, e[i].start, e[i].len);
+    if(ip->addrs[EXTBLOCK]){
+      bp = bread(ip->dev, ip->addrs[EXTBLOCK]);
+      e = (struct extent*)bp->data;
+      for(j = 0; j < NEXTENT && e[j].len; j++)
+        bfreerange(ip->dev, e[j].start, e[j].len);
+      brelse(bp);
+      bfree(ip->dev, ip->addrs[EXTBLOCK]);
+    }
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    if(ip->type == T_FILE)
+      ip->flags |= IINLINE;  // empty again
+    ip->size = 0;
+    ip->maplen = 0;
+    iupdate(ip);
+    return;
+  }
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -436,22 +924,158 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < 3; i++){
+    if(ip->addrs[NDIRECT+i]){
+      ifree(ip->dev, ip->addrs[NDIRECT+i], i + 1);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
   ip->size = 0;
+  ip->maplen = 0;
   iupdate(ip);
 }
 
+// Delayed allocation.
+//
+// Blocks appended to a regular extent-mapped file are not
+// given disk blocks by writei() straight away. Up to DABLOCKS
+// of them at a time are held in a page of memory, ip->dadata,
+// as blocks ip->dabn .. ip->dabn+ip->dan-1, each with a free
+// block reserved for it, plus one for a block of extents.
+// iflush() then allocates them all as one run, and writes them
+// through the log in one transaction: when the page is full
+// and the file grows again, or when fileclose() closes a file
+// open for writing. Until then the on-disk inode's size stops
+// at ip->dabn, so a crash loses the delayed writes but leaves
+// the file consistent.
+//
+// A block is only delayed if iflush() can't then fail: the
+// reservation covers the blocks it allocates, and the file has
+// room for DABLOCKS more extents.
+
+#define DABLOCKS (PGSIZE / BSIZE)
+
+// Number of extents ip's extent list holds.
+// Caller holds ip->lock.
+static int
+iextents(struct inode *ip)
+{
+  struct extent *e;
+  struct buf *bp;
+  int n;
+
+  e = (struct extent*)ip->addrs;
+  for(n = 0; n < NIEXTENT && e[n].len; n++)
+    ;
+  if(n < NIEXTENT || ip->addrs[EXTBLOCK] == 0)
+    return n;
+  bp = bread(ip->dev, ip->addrs[EXTBLOCK]);
+  e = (struct extent*)bp->data;
+  for(; n < NIEXTENT + NEXTENT && e[n - NIEXTENT].len; n++)
+    ;
+  brelse(bp);
+  return n;
+}
+
+// Return the in-memory copy of block bn of ip if it is
+// delayed, or can become delayed because it is the next new
+// block of the file; otherwise 0, and writei() should
+// allocate it as usual. Caller holds ip->lock and is in a
+// transaction, which may have to include an iflush().
+static char*
+idelay(struct inode *ip, uint bn)
+{
+  if(ip->dan > 0 && bn - ip->dabn < ip->dan)
+    return ip->dadata + (bn - ip->dabn) * BSIZE;
+  if(ip->type != T_FILE || (ip->flags & IEXTENT) == 0)
+    return 0;
+  if(bn < (ip->size + BSIZE - 1) / BSIZE)
+    return 0;  // already has a block
+  if(ip->dan > 0 && bn != ip->dabn + ip->dan)
+    return 0;
+  if(ip->dan == DABLOCKS)
+    iflush(ip);
+  if(ip->dan == 0){
+    if(iextents(ip) + DABLOCKS > NIEXTENT + NEXTENT)
+      return 0;
+    if(bsumreserve(2) < 0)
+      return 0;
+    if((ip->dadata = kalloc()) == 0){
+      bsumunreserve(2);
+      return 0;
+    }
+    ip->dares = 2;
+    ip->dabn = bn;
+  } else {
+    if(bsumreserve(1) < 0)
+      return 0;
+    ip->dares++;
+  }
+  memset(ip->dadata + ip->dan * BSIZE, 0, BSIZE);
+  ip->dan++;
+  return ip->dadata + (ip->dan - 1) * BSIZE;
+}
+
+// Allocate disk blocks for ip's delayed blocks and write them
+// out. Caller holds ip->lock and is in a transaction with room
+// for IPUTBLOCKS blocks.
+void
+iflush(struct inode *ip)
+{
+  struct buf *bp;
+  uint i, addr;
+
+  if(ip->dan == 0)
+    return;
+
+  // balloc() takes the blocks out of ip->dares.
+  for(i = 0; i < ip->dan; i++){
+    if((addr = bmap(ip, ip->dabn + i, ip->dan - i)) == 0)
+      panic("iflush");
+    bp = bread(ip->dev, addr);
+    memmove(bp->data, ip->dadata + i*BSIZE, BSIZE);
+    log_write(bp);
+    brelse(bp);
+  }
+  // the block for extents, if it wasn't needed.
+  bsumunreserve(ip->dares);
+  ip->dares = 0;
+  kfree(ip->dadata);
+  ip->dadata = 0;
+  ip->dan = 0;
+  iupdate(ip);
+}
+
+// Throw away ip's delayed blocks, if any.
+static void
+idiscard(struct inode *ip)
+{
+  if(ip->dan == 0)
+    return;
+  bsumunreserve(ip->dares);
+  ip->dares = 0;
+  kfree(ip->dadata);
+  ip->dadata = 0;
+  ip->dan = 0;
+}
+
+// Number of disk blocks holding ip's data: every block
+// below size, but for delayed ones and inline data, is
+// mapped. Caller must hold ip->lock.
+static uint
+inblocks(struct inode *ip)
+{
+  uint nb;
+
+  nb = (ip->size + BSIZE - 1) / BSIZE;
+  if(ip->dan > 0 && nb > ip->dabn)
+    nb = ip->dabn;
+  if(ip->flags & IINLINE)
+    nb = 0;
+  return nb;
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -462,6 +1086,29 @@ stati(struct inode *ip, struct stat *st)
   st->type = ip->type;
   st->nlink = ip->nlink;
   st->size = ip->size;
+  st->blocks = inblocks(ip);
+}
+
+// Count the runs of contiguous disk blocks ip's data
+// occupies. Reads the whole block map, so it isn't part of
+// stati(). Caller must hold ip->lock.
+int
+iruns(struct inode *ip)
+{
+  uint bn, nb, addr, prev;
+  int runs;
+
+  // the blocks are all mapped, so bmap() won't
+  // allocate anything here.
+  nb = inblocks(ip);
+  runs = 0;
+  for(bn = 0, prev = 0; bn < nb; bn++){
+    addr = bmap(ip, bn, 1);
+    if(bn == 0 || addr != prev + 1)
+      runs++;
+    prev = addr;
+  }
+  return runs;
 }
 
 // Read data from inode.
@@ -471,7 +1118,7 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, bn, ra;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -479,12 +1126,34 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  if(ip->flags & IINLINE){
+    if(either_copyout(user_dst, dst, (char*)ip->addrs + off, n) == -1)
+      return -1;
+    return n;
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    m = min(n - tot, BSIZE - off%BSIZE);
+    if(ip->dan > 0 && off/BSIZE - ip->dabn < ip->dan){
+      // a delayed block: only in memory.
+      if(either_copyout(user_dst, dst, ip->dadata + (off - ip->dabn*BSIZE), m) == -1){
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    bn = off/BSIZE;
+    uint addr = bmap(ip, bn, 1);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
+    // read ahead along the run of blocks bmap() found,
+    // within the file.
+    ra = 1;
+    if(bn - ip->mapbn < ip->maplen)
+      ra = ip->maplen - (bn - ip->mapbn);
+    if(ra > (ip->size - 1) / BSIZE - bn + 1)
+      ra = (ip->size - 1) / BSIZE - bn + 1;
+    bp = breadn(ip->dev, addr, ra);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -495,6 +1164,30 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Move the data of inline inode ip out to a block, as it
+// is about to outgrow the inode. Caller holds ip->lock and
+// is in a transaction. Returns 0, or -1 if out of space.
+static int
+iuninline(struct inode *ip)
+{
+  char data[NINLINE];
+  uint size = ip->size;
+
+  memmove(data, ip->addrs, size);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->flags &= ~IINLINE;
+  ip->size = 0;
+  ip->maplen = 0;
+  if(size > 0 && writei(ip, 0, (uint64)data, 0, size) != size){
+    // nothing was allocated: put it back.
+    memmove(ip->addrs, data, size);
+    ip->flags |= IINLINE;
+    ip->size = size;
+    return -1;
+  }
+  return 0;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -507,18 +1200,37 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *p;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  if(ip->flags & IINLINE){
+    if(off + n <= NINLINE){
+      if(either_copyin((char*)ip->addrs + off, user_src, src, n) == -1)
+        return 0;
+      if(off + n > ip->size)
+        ip->size = off + n;
+      iupdate(ip);
+      return n;
+    }
+    if(iuninline(ip) < 0)
+      return 0;
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    m = min(n - tot, BSIZE - off%BSIZE);
+    if((p = idelay(ip, off/BSIZE)) != 0){
+      if(either_copyin(p + off%BSIZE, user_src, src, m) == -1)
+        break;
+      continue;
+    }
+    uint addr = bmap(ip, off/BSIZE, (off + n - tot - 1)/BSIZE - off/BSIZE + 1);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
@@ -546,40 +1258,142 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Hash bucket of a name in an indexed directory.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h % NDIRHASH;
+}
+
+// Does dp have a hash index in block 1?
+static int
+dirindexed(struct inode *dp)
+{
+  struct dirindex di;
+
+  if(dp->size < 2*BSIZE)
+    return 0;
+  if(readi(dp, 0, (uint64)&di, BSIZE, sizeof(di)) != sizeof(di))
+    panic("dirindexed read");
+  return di.inum == 0 && di.magic == DIRMAGIC;
+}
+
+// Byte offset in an indexed directory of the head of bucket h.
+static uint
+dirheadoff(uint h)
+{
+  return BSIZE + (1 + h/DIRHEADS) * sizeof(struct dirheads)
+    + 2 + (h%DIRHEADS) * sizeof(ushort);
+}
+
+// Look for name among the dirents of dp in [off, end).
+// If name is found, return its inum and set *poff to its
+// offset; if name is 0, look for an empty dirent instead
+// and return 1 if there is one.
+static uint
+dirscan(struct inode *dp, uint off, uint end, char *name, uint *poff)
+{
+  struct dirent de;
+
+  for(; off < end; off += sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirscan read");
+    if(name == 0 ? de.inum == 0 : de.inum != 0 && namecmp(name, de.name) == 0){
+      // entry matches path element
+      *poff = off;
+      return name ? de.inum : 1;
+    }
+  }
+  return 0;
+}
+
+// Look for name, or an empty dirent if name is 0, in
+// dp's first block, or all of dp if it has no index,
+// and then along name's bucket chain if it does.
+static uint
+dirfind(struct inode *dp, char *name, char *hname, uint *poff)
+{
+  uint inum, b;
+  struct dirindex di;
+  ushort head;
+  int indexed;
+
+  indexed = dirindexed(dp);
+  if((inum = dirscan(dp, 0, indexed ? BSIZE : dp->size, name, poff)) != 0 || !indexed)
+    return inum;
+
+  if(readi(dp, 0, (uint64)&head, dirheadoff(dirhash(hname)), sizeof(head)) != sizeof(head))
+    panic("dirfind read");
+  for(b = head; b != 0; b = di.next){
+    if(readi(dp, 0, (uint64)&di, b*BSIZE, sizeof(di)) != sizeof(di) || di.magic != DIRMAGIC)
+      panic("dirfind leaf");
+    if((inum = dirscan(dp, b*BSIZE + sizeof(di), (b+1)*BSIZE, name, poff)) != 0)
+      return inum;
+  }
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Unless the caller wants the offset, the answer may
+// come from the dcache rather than dp's blocks.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
-  struct dirent de;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
-    }
+  if(poff == 0 && dcachelookup(dp->dev, dp->inum, name, &inum))
+    return inum ? iget(dp->dev, inum) : 0;
+
+  if((inum = dirfind(dp, name, name, &off)) != 0){
+    if(poff)
+      *poff = off;
+    dcacheenter(dp->dev, dp->inum, name, inum);
+    return iget(dp->dev, inum);
   }
 
+  dcacheenter(dp->dev, dp->inum, name, 0);
   return 0;
 }
 
+// Write the block of directory dp at byte offset off, which
+// must be dp->size, as an index or leaf: a dirindex header
+// with the given next, then empty slots.
+// Returns 0 on success, -1 on failure.
+static int
+dirnewblock(struct inode *dp, uint off, ushort next)
+{
+  struct dirindex *di;
+  char *mem;
+  int r;
+
+  // build the whole block, so that it takes one writei().
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, BSIZE);
+  di = (struct dirindex*)mem;
+  di->magic = DIRMAGIC;
+  di->next = next;
+  r = writei(dp, 0, (uint64)mem, off, BSIZE) == BSIZE ? 0 : -1;
+  kfree(mem);
+  return r;
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  uint off, hoff;
+  ushort head;
   struct dirent de;
   struct inode *ip;
 
@@ -589,18 +1403,35 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  // Look for an empty dirent where dirlookup() would look.
+  if(dirfind(dp, 0, name, &off) == 0){
+    off = dp->size;
+    if(dp->size == BSIZE){
+      // the first block is full: add an index, with
+      // all chains empty.
+      if(dirnewblock(dp, BSIZE, 0) < 0)
+        return -1;
+    }
+    if(dirindexed(dp)){
+      // start a new leaf at the head of name's chain.
+      hoff = dirheadoff(dirhash(name));
+      if(readi(dp, 0, (uint64)&head, hoff, sizeof(head)) != sizeof(head))
+        panic("dirlink read");
+      off = dp->size;
+      if(dirnewblock(dp, off, head) < 0)
+        return -1;
+      head = off / BSIZE;
+      if(writei(dp, 0, (uint64)&head, hoff, sizeof(head)) != sizeof(head))
+        return -1;
+      off += sizeof(struct dirindex);
+    }
   }
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcacheenter(dp->dev, dp->inum, name, inum);
 
   return 0;
 }
@@ -652,11 +1483,16 @@ static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
+  struct proc *p = myproc()->leader;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  else {
+    // another thread may chdir() and iput() the old cwd.
+    acquire(&p->tlock);
+    ip = idup(p->cwd);
+    release(&p->tlock);
+  }
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
@@ -24,9 +24,32 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
+#define NADDRS 28
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
+
+// Inode flags.
+#define IEXTENT 0x1     // addrs[] holds extents, not block numbers
+#define IINLINE 0x2     // addrs[] holds the file's data itself
+
+// Bytes of data an IINLINE inode can hold.
+#define NINLINE (NADDRS * sizeof(uint))
+
+// A run of len blocks starting at disk block start.
+// An extent-mapped inode's blocks are its extents in order:
+// NIEXTENT in addrs[], then NEXTENT more in the block at
+// addrs[EXTBLOCK]. The first extent with len 0 ends the list.
+struct extent {
+  uint start;
+  uint len;
+};
+
+#define NIEXTENT ((NADDRS-1) / 2)
+#define EXTBLOCK (NADDRS-1)
+#define NEXTENT (BSIZE / sizeof(struct extent))
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +58,8 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint flags;           // IEXTENT, IINLINE
+  uint addrs[NADDRS];   // Data block addresses, extents, or data
 };
 
 // Inodes per block.
@@ -58,3 +82,28 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory that outgrows its first block gets a hash index.
+// Block 0 stays a plain array of dirents. Block 1 is the index:
+// a dirindex header, then the heads of NDIRHASH bucket chains.
+// Every later block is a leaf on one bucket's chain: a dirindex
+// header, then dirents. Headers and index slots all have inum
+// 0, so code that reads a directory as an array of dirents
+// (ls, isdirempty(), older kernels) skips them and still sees
+// every entry. A directory whose block 1 doesn't start with
+// the magic number is searched linearly.
+#define DIRMAGIC  0x6874     // "ht"
+#define NDIRHASH  64
+#define DIRHEADS  7          // chain heads per index slot
+
+struct dirindex {
+  ushort inum;               // always 0
+  ushort magic;              // DIRMAGIC
+  ushort next;               // leaf: next block in chain, or 0
+  char pad[DIRSIZ-4];
+};
+
+struct dirheads {
+  ushort inum;               // always 0
+  ushort head[DIRHEADS];     // first leaf block of each bucket, or 0
+};
+
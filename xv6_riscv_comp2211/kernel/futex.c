@@ -0,0 +1,135 @@
+//
+// Futexes: sleep until a word of user memory changes.
+//
+// futexwait(addr, val) sleeps if the int at addr still holds
+// val; futexwake(addr, n) wakes up to n processes sleeping on
+// addr. A futex is named by the physical address of the word,
+// so processes sharing memory through mmap() or shm segments
+// find each other even if the word is mapped at different
+// virtual addresses. Waiters are kept on per-bucket lists in a
+// hashed table, and the bucket lock is held from the check of
+// *addr until sleep(), so a wake between the two isn't missed.
+//
+// User-level locks (ulib.c) only make these calls when there
+// is contention.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define NFUTEXHASH 64
+
+// A sleeping process. Lives on the waiter's kernel stack.
+struct futexwaiter {
+  uint64 pa;                   // physical address waited on
+  int woken;
+  struct futexwaiter *next;
+};
+
+struct futexbucket {
+  struct spinlock lock;
+  struct futexwaiter *head;
+};
+
+static struct futexbucket futextab[NFUTEXHASH];
+
+void
+futexinit(void)
+{
+  struct futexbucket *b;
+
+  for(b = futextab; b < &futextab[NFUTEXHASH]; b++)
+    initlock(&b->lock, "futex");
+}
+
+static struct futexbucket*
+futexhash(uint64 pa)
+{
+  return &futextab[(pa >> 2) % NFUTEXHASH];
+}
+
+// Physical address of the aligned user int at va,
+// faulting its page in if necessary. Returns 0 on error.
+static uint64
+futexaddr(uint64 va)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+  int x;
+
+  if(va % sizeof(int) != 0)
+    return 0;
+  if(copyin(p->pagetable, (char*)&x, va, sizeof(x)) < 0)
+    return 0;
+  if((pa = walkaddr(p->pagetable, va)) == 0)
+    return 0;
+  return pa + (va & (PGSIZE - 1));
+}
+
+// Sleep until woken by futexwake() on the same word, if the
+// int at user address va is equal to val. Returns 0 if woken,
+// -1 if the value differed or the process was killed.
+int
+futexwait(uint64 va, int val)
+{
+  struct futexbucket *b;
+  struct futexwaiter w, **pp;
+  uint64 pa;
+
+  if((pa = futexaddr(va)) == 0)
+    return -1;
+  b = futexhash(pa);
+
+  acquire(&b->lock);
+  if(*(volatile int*)pa != val){
+    release(&b->lock);
+    return -1;
+  }
+  w.pa = pa;
+  w.woken = 0;
+  w.next = b->head;
+  b->head = &w;
+  while(!w.woken && !killed(myproc()))
+    sleep(&w, &b->lock);
+  if(!w.woken){
+    for(pp = &b->head; *pp != &w; pp = &(*pp)->next)
+      ;
+    *pp = w.next;
+  }
+  release(&b->lock);
+  return w.woken ? 0 : -1;
+}
+
+// Wake up to n processes waiting on the int at user address va.
+// Returns the number woken, or -1.
+int
+futexwake(uint64 va, int n)
+{
+  struct futexbucket *b;
+  struct futexwaiter *w, **pp;
+  uint64 pa;
+  int woken = 0;
+
+  if((pa = futexaddr(va)) == 0)
+    return -1;
+  b = futexhash(pa);
+
+  acquire(&b->lock);
+  for(pp = &b->head; (w = *pp) != 0 && woken < n; ){
+    if(w->pa == pa){
+      *pp = w->next;
+      w->woken = 1;
+      wakeup(w);
+      woken++;
+    } else {
+      pp = &w->next;
+    }
+  }
+  release(&b->lock);
+  return woken;
+}
@@ -1,6 +1,7 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// and whole 2 MiB superpages from a pool set aside at boot.
 
 #include "types.h"
 #include "param.h"
@@ -21,13 +22,26 @@ struct run {
 struct {
   struct spinlock lock;
   struct run *freelist;
+  struct run *superfreelist; // free SUPERPGSIZE-aligned superpages
+  // number of page tables (or other owners) holding each
+  // allocated page, indexed by physical page number.
+  int ref[(PHYSTOP-KERNBASE)/PGSIZE];
 } kmem;
 
+#define PA2REF(pa) (kmem.ref[((uint64)(pa) - KERNBASE) / PGSIZE])
+
 void
 kinit()
 {
+  char *p, *superstart;
+
   initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  superstart = (char*)SUPERPGROUNDDOWN(PHYSTOP - NSUPERPG*SUPERPGSIZE);
+  if(superstart < (char*)SUPERPGROUNDUP((uint64)end))
+    superstart = (char*)SUPERPGROUNDUP((uint64)end);
+  freerange(end, superstart);
+  for(p = superstart; p + SUPERPGSIZE <= (char*)PHYSTOP; p += SUPERPGSIZE)
+    superfree(p);
 }
 
 void
@@ -35,14 +49,16 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    PA2REF(p) = 1;
     kfree(p);
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
+// Drop a reference to the page of physical memory pointed at by pa,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator; see kinit above.)
 void
 kfree(void *pa)
 {
@@ -51,6 +67,15 @@ kfree(void *pa)
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  acquire(&kmem.lock);
+  if(PA2REF(pa) < 1)
+    panic("kfree: ref");
+  if(--PA2REF(pa) > 0){
+    release(&kmem.lock);
+    return;
+  }
+  release(&kmem.lock);
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
@@ -72,11 +97,85 @@ kalloc(void)
 
   acquire(&kmem.lock);
   r = kmem.freelist;
-  if(r)
+  if(r == 0 && kmem.superfreelist){
+    // out of pages; break up a superpage.
+    struct run *s = kmem.superfreelist;
+    kmem.superfreelist = s->next;
+    for(char *p = (char*)s; p < (char*)s + SUPERPGSIZE; p += PGSIZE){
+      r = (struct run*)p;
+      r->next = kmem.freelist;
+      kmem.freelist = r;
+    }
+  }
+  if(r){
     kmem.freelist = r->next;
+    PA2REF(r) = 1;
+  }
   release(&kmem.lock);
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// Add a reference to an allocated page, e.g. when it is
+// mapped into a second page table. kfree() drops it again.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+
+  acquire(&kmem.lock);
+  if(PA2REF(pa) < 1)
+    panic("kdup: ref");
+  PA2REF(pa)++;
+  release(&kmem.lock);
+}
+
+// Free the superpage of physical memory pointed at by pa,
+// which normally should have been returned by a
+// call to superalloc().  (The exception is when
+// initializing the allocator; see kinit above.)
+void
+superfree(void *pa)
+{
+  struct run *r;
+
+  if(((uint64)pa % SUPERPGSIZE) != 0 || (char*)pa < end ||
+     (uint64)pa + SUPERPGSIZE > PHYSTOP)
+    panic("superfree");
+
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, SUPERPGSIZE);
+
+  r = (struct run*)pa;
+
+  acquire(&kmem.lock);
+  r->next = kmem.superfreelist;
+  kmem.superfreelist = r;
+  release(&kmem.lock);
+}
+
+// Allocate one SUPERPGSIZE-aligned superpage of physical memory.
+// Returns a pointer that the kernel can use.
+// Returns 0 if no superpage is free.
+void *
+superalloc(void)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  r = kmem.superfreelist;
+  if(r){
+    kmem.superfreelist = r->next;
+    // once split, the superpage's pages are freed one by one.
+    for(int i = 0; i < SUPERPGSIZE/PGSIZE; i++)
+      PA2REF((char*)r + i*PGSIZE) = 1;
+  }
+  release(&kmem.lock);
+
+  if(r)
+    memset((char*)r, 5, SUPERPGSIZE); // fill with junk
+  return (void*)r;
+}
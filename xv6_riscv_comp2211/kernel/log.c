@@ -3,6 +3,7 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -16,125 +17,259 @@
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op(n) reserves room in the log
+// for the n blocks the call might write, and usually just
+// returns. But if the log can't hold that on top of what
+// it holds and has promised already, it sleeps until
+// enough outstanding calls end, or the last commits, or
+// a checkpoint frees up the log.
 //
-// The log is a physical re-do log containing disk blocks.
+// The log's size comes from the superblock, up to what a
+// descriptor block can list and what the buffer cache can
+// keep pinned during a commit.
+//
+// The log is a physical re-do log containing disk blocks,
+// used as a circular journal of committed transactions.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+//   tail block: where in the ring the oldest transaction
+//               not yet installed starts, and its sequence #
+//   ring of blocks holding transactions, each
+//     descriptor block, containing its sequence #, a checksum
+//       and block #s for block A, B, C, ...
+//     block A
+//     block B
+//     block C
+//     ...
+// commit() appends a transaction to the ring, writing its blocks
+// and descriptor as one batch that the disk may complete in any
+// order. The transaction counts as committed once all of it is
+// on disk, which recovery tells by the checksum. It doesn't install
+// the blocks at their home locations, but leaves them dirty in the
+// buffer cache, where reads find them and whose flusher writes them
+// home in the background (see bio.c). When the ring is half full or
+// a begin_op() needs room, the checkpoint thread writes home those
+// still dirty and empties the ring. A block written by many
+// transactions, like a bitmap or inode block, is usually written
+// home once (absorption).
+
+#define LOGMAGIC 0x10676f6c
+
+// Most blocks a descriptor block can list.
+#define LOGMAX (BSIZE / sizeof(int) - 4)
+
+// Contents of a descriptor block, used for both the on-disk
+// descriptors and to keep track in memory of logged block#
+// before commit.
 struct logheader {
+  uint magic;
+  uint sum;        // checksum of seq, n, block[] and the log blocks
+  uint seq;
   int n;
-  int block[LOGSIZE];
+  int block[LOGMAX];
+};
+
+// Contents of the tail block.
+struct logtail {
+  uint magic;
+  uint seq;        // sequence # of the transaction at tail
+  uint tail;       // ring position of the oldest transaction
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in the ring
+  int reserved;    // blocks reserved, and not yet logged, by executing FS sys calls
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int cpwant;      // checkpoint requested
+  int checkpointing; // checkpoint waiting or running, please wait.
   int dev;
   struct logheader lh;
+
+  // the ring. only commit() and checkpoint() use these,
+  // and never at the same time.
+  uint head;       // ring position for the next transaction
+  uint used;       // ring blocks holding uninstalled transactions
+  uint seq;        // sequence # for the next transaction
+  int npend;       // committed blocks not yet installed
+  int pend[LOGMAX];
+  struct buf *wbuf[LOGMAX+1]; // a batch of writes
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void checkpointer(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog - 1;
+  if(log.size > LOGMAX)
+    log.size = LOGMAX;
+  // a commit keeps every logged block, and its copy for
+  // the ring, in the cache.
+  if(log.size > (NBUF - MAXOPBLOCKS) / 2)
+    log.size = (NBUF - MAXOPBLOCKS) / 2;
+  if(log.size < MAXOPBLOCKS + 1)
+    panic("initlog: log too small");
   log.dev = dev;
   recover_from_log();
+  if(kthread(checkpointer, "logcp") < 0)
+    panic("initlog: checkpointer");
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(int recovering)
+// Add n bytes at p to checksum sum (32-bit FNV-1a).
+static uint
+logsum(uint sum, uchar *p, int n)
 {
-  int tail;
+  while(n-- > 0)
+    sum = (sum ^ *p++) * 16777619;
+  return sum;
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+// Checksum of the descriptor's own fields, to start the
+// checksum of its transaction with.
+static uint
+logsumhead(struct logheader *lh)
+{
+  return logsum(2166136261, (uchar*)&lh->seq,
+                2*sizeof(int) + lh->n*sizeof(int));
 }
 
-// Read the log header from disk into the in-memory log header
+// Disk block holding ring position pos.
+static int
+ringblock(uint pos)
+{
+  return log.start + 1 + pos % log.size;
+}
+
+// Write the tail block: the ring is empty from log.head on.
 static void
-read_head(void)
+write_tail(void)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct logtail *lt = (struct logtail *) (buf->data);
+
+  lt->magic = LOGMAGIC;
+  lt->seq = log.seq;
+  lt->tail = log.head;
+  bwrite(buf);
+  brelse(buf);
+}
+
+// Did all of the transaction whose descriptor lh is at ring
+// position pos reach the disk? A crash during commit() may
+// leave any of its blocks, or the descriptor, unwritten.
+static int
+log_complete(uint pos, struct logheader *lh)
+{
+  struct buf *lbuf;
+  uint sum;
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+
+  sum = logsumhead(lh);
+  for(i = 0; i < lh->n; i++){
+    lbuf = bread(log.dev, ringblock(pos + 1 + i));
+    sum = logsum(sum, lbuf->data, BSIZE);
+    brelse(lbuf);
   }
-  brelse(buf);
+  return sum == lh->sum;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Replay each committed transaction in the ring, from the
+// tail on, copying its blocks from the log to their home
+// locations. Then empty the ring.
 static void
-write_head(void)
+recover_from_log(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct buf *buf, *lbuf, *dbuf;
+  struct logtail *lt;
+  struct logheader *lh;
+  uint pos, seq, done;
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  buf = bread(log.dev, log.start);
+  lt = (struct logtail *) (buf->data);
+  if(lt->magic == LOGMAGIC){
+    pos = lt->tail % log.size;
+    seq = lt->seq;
+  } else {
+    pos = 0;   // a new log
+    seq = 1;
   }
-  bwrite(buf);
   brelse(buf);
+
+  for(done = 0; done < log.size; ){
+    buf = bread(log.dev, ringblock(pos));
+    lh = (struct logheader *) (buf->data);
+    if(lh->magic != LOGMAGIC || lh->seq != seq ||
+       lh->n < 0 || lh->n + 1 > log.size - done ||
+       !log_complete(pos, lh)){
+      brelse(buf);
+      break;
+    }
+    for(i = 0; i < lh->n; i++){
+      lbuf = bread(log.dev, ringblock(pos + 1 + i)); // read log block
+      dbuf = bread(log.dev, lh->block[i]); // read dst
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      bwrite(dbuf);  // write dst to disk
+      brelse(lbuf);
+      brelse(dbuf);
+    }
+    pos = (pos + 1 + lh->n) % log.size;
+    done += 1 + lh->n;
+    seq++;
+    brelse(buf);
+  }
+
+  log.head = pos;
+  log.seq = seq;
+  log.used = 0;
+  write_tail(); // clear the log
 }
 
-static void
-recover_from_log(void)
+// Most blocks one FS system call may reserve. Callers that
+// can split their work, like filewrite(), size each piece
+// to fit, leaving the rest of the log to other calls.
+int
+log_opmax(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  if(log.size / 4 < MAXOPBLOCKS)
+    return MAXOPBLOCKS;
+  return log.size / 4;
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call,
+// which will write at most n blocks.
 void
-begin_op(void)
+begin_op(int n)
 {
+  if(n + 1 > log.size)
+    panic("begin_op: too big");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.committing || log.checkpointing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + log.reserved + n + 1 > log.size - log.used){
+      // this op might exhaust log space; wait for commit,
+      // and for a checkpoint if the ring is what's full.
+      if(log.used > 0){
+        log.cpwant = 1;
+        wakeup(&log.cpwant);
+      }
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      myproc()->logres = n;
       release(&log.lock);
       break;
     }
@@ -150,6 +285,8 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= myproc()->logres;
+  myproc()->logres = 0;
   if(log.committing)
     panic("log.committing");
   if(log.outstanding == 0){
@@ -157,8 +294,7 @@ end_op(void)
     log.committing = 1;
   } else {
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // and this call's reservation has been released.
     wakeup(&log);
   }
   release(&log.lock);
@@ -169,24 +305,69 @@ end_op(void)
     commit();
     acquire(&log.lock);
     log.committing = 0;
+    if(log.used > log.size / 2){
+      log.cpwant = 1;
+      wakeup(&log.cpwant);
+    }
     wakeup(&log);
     release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to the ring, then write
+// them and the descriptor, which comes before them, at once.
+// Unless the ring wraps, they are adjacent, and the disk
+// gets a few large requests.
 static void
 write_log(void)
 {
+  struct buf *buf;
+  uint sum;
   int tail;
 
+  log.lh.magic = LOGMAGIC;
+  log.lh.seq = log.seq;
+  sum = logsumhead(&log.lh);
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
+    struct buf *to = bnew(log.dev, ringblock(log.head+1+tail)); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    sum = logsum(sum, to->data, BSIZE);
     brelse(from);
-    brelse(to);
+    log.wbuf[1+tail] = to;
+  }
+
+  log.lh.sum = sum;
+  buf = bnew(log.dev, ringblock(log.head));
+  memset(buf->data, 0, BSIZE);
+  memmove(buf->data, &log.lh, sizeof(log.lh));
+  log.wbuf[0] = buf;
+
+  bwritev(log.wbuf, log.lh.n + 1);  // write the log
+  for (tail = 0; tail <= log.lh.n; tail++)
+    brelse(log.wbuf[tail]);
+}
+
+// The transaction has committed: hand its blocks to the buffer
+// cache to write home, giving back the pins log_write() took,
+// and add them to those the next checkpoint must see installed.
+static void
+pend_trans(void)
+{
+  struct buf *b;
+  int i, j;
+
+  for(i = 0; i < log.lh.n; i++){
+    b = bread(log.dev, log.lh.block[i]);
+    bdirty(b);
+    bunpin(b);
+    brelse(b);
+    for(j = 0; j < log.npend; j++){
+      if(log.pend[j] == log.lh.block[i])   // absorption
+        break;
+    }
+    if(j == log.npend)
+      log.pend[log.npend++] = log.lh.block[i];
   }
 }
 
@@ -194,11 +375,59 @@ static void
 commit()
 {
   if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+    write_log();     // Write blocks and checksummed descriptor -- the real commit
+    pend_trans();    // Write them home later
+    log.head = (log.head + 1 + log.lh.n) % log.size;
+    log.used += 1 + log.lh.n;
+    log.seq++;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  }
+}
+
+// Make sure every committed block is at its home location,
+// writing those the flusher hasn't from the cache, which holds
+// just what was committed as no FS system call is executing.
+// Then mark the ring empty. The blocks go out in block order,
+// so that runs of adjacent ones become single disk requests.
+static void
+checkpoint(void)
+{
+  int i, j, t;
+
+  if(log.used == 0)
+    return;
+  for(i = 1; i < log.npend; i++){
+    t = log.pend[i];
+    for(j = i; j > 0 && log.pend[j-1] > t; j--)
+      log.pend[j] = log.pend[j-1];
+    log.pend[j] = t;
+  }
+  bsync(log.dev, log.pend, log.npend);
+  log.npend = 0;
+  write_tail();    // Erase the transactions from the log
+  log.used = 0;
+}
+
+// The checkpoint thread. When asked, holds off new FS system
+// calls until those executing have committed, then installs.
+static void
+checkpointer(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    while(!log.cpwant)
+      sleep(&log.cpwant, &log.lock);
+    log.checkpointing = 1;
+    while(log.outstanding > 0 || log.committing)
+      sleep(&log, &log.lock);
+    release(&log.lock);
+
+    checkpoint();
+
+    acquire(&log.lock);
+    log.checkpointing = 0;
+    log.cpwant = 0;
+    wakeup(&log);
   }
 }
 
@@ -217,8 +446,6 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
@@ -226,11 +453,19 @@ log_write(struct buf *b)
     if (log.lh.block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
+    // the transaction, with its descriptor, must fit in
+    // the part of the ring not holding older ones.
+    if (log.lh.n + 1 + 1 > log.size - log.used)
+      panic("too big a transaction");
+    // a new block uses up some of this call's reservation.
+    if (myproc()->logres < 1)
+      panic("log_write: op exceeds its reservation");
+    myproc()->logres--;
+    log.reserved--;
     bpin(b);
     log.lh.n++;
   }
+  log.lh.block[i] = b->blockno;
   release(&log.lock);
 }
-
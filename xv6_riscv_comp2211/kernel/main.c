@@ -25,8 +25,12 @@ main()
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    blkinit();       // block request queue
     iinit();         // inode table
+    dcacheinit();    // directory entry cache
     fileinit();      // file table
+    shminit();       // shared memory segments
+    futexinit();     // futex wait table
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
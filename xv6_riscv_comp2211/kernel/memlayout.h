@@ -62,6 +62,10 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap() regions, allocated downwards from MMAPTOP
+//   trapframes of threads made by clone(), one page each
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define TTRAPFRAME(t) (TRAPFRAME - (t)*PGSIZE)
+#define MMAPTOP   TTRAPFRAME(NTHREAD-1)
@@ -0,0 +1,460 @@
+//
+// Memory-mapped files and anonymous memory: mmap() and munmap().
+//
+// Each process has up to NVMA regions, recorded in its leader's
+// p->vma[] and placed downwards from MMAPTOP. No memory is allocated by mmap()
+// itself; mmapfault() allocates (and, for a file, reads) each page
+// the first time the process or copyin()/copyout() touches it.
+// Dirty pages of MAP_SHARED file regions are written back to the
+// file by munmap(), exit() and exec(). Shared memory segments
+// (shm.c) are attached as regions too.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Return the region of p containing va, or 0.
+static struct vma*
+findvma(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && va >= v->addr && va < v->addr + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// PTE permission bits for a region's prot.
+static int
+vmaperm(struct vma *v)
+{
+  int perm = PTE_U;
+
+  if(v->prot & PROT_READ)
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_R | PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// May v's pages be written back to its file?
+static int
+vmawritable(struct vma *v)
+{
+  return v->f && v->f->writable &&
+    (v->flags & MAP_SHARED) && (v->prot & PROT_WRITE);
+}
+
+// Lowest address used by p's mmap() regions, or MMAPTOP
+// if there are none. The heap must stay below it.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = MMAPTOP;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && v->addr < base)
+      base = v->addr;
+  }
+  return base;
+}
+
+// Find room for a region of len bytes (page-aligned) in p,
+// in the highest gap below MMAPTOP that fits, and claim a
+// free slot in p->vma[] for it. p must be a leader.
+// Returns the new region, with only addr and len set,
+// or 0 if there is no room.
+struct vma*
+vmaalloc(struct proc *p, uint64 len)
+{
+  struct vma *v, *nv;
+  uint64 a;
+  int i;
+
+  if(len == 0 || len > MMAPTOP)
+    return 0;
+
+  acquire(&p->tlock);
+  nv = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0){
+      nv = v;
+      break;
+    }
+  }
+  if(nv == 0)
+    goto bad;
+
+  a = MMAPTOP - len;
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->len > 0 && a < v->addr + v->len && v->addr < a + len){
+      if(v->addr < len)
+        goto bad;
+      a = v->addr - len;
+      i = -1; // start over
+    }
+  }
+  if(a < PGROUNDUP(p->sz))
+    goto bad;
+
+  memset(nv, 0, sizeof(*nv));
+  nv->addr = a;
+  nv->len = len;
+  release(&p->tlock);
+  return nv;
+
+ bad:
+  release(&p->tlock);
+  return 0;
+}
+
+// Map len bytes of f starting at file offset off, or zero-filled
+// memory if f is 0, into the current process. addr is only a
+// hint, and is ignored. Returns the address of the region,
+// or -1 on error.
+uint64
+mmap(uint64 addr, uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v;
+
+  if(len == 0 || len > MMAPTOP || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if(f){
+    if(f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  if((v = vmaalloc(p, PGROUNDUP(len))) == 0)
+    return -1;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+  return v->addr;
+}
+
+// Write the page at va, physical address pa, of MAP_SHARED
+// region v back to v's file, a few blocks per transaction
+// as in filewrite(). Never extends the file.
+static void
+writeback(struct vma *v, uint64 va, uint64 pa)
+{
+  struct inode *ip = v->f->ip;
+  uint off = v->off + (va - v->addr);
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint i, n;
+
+  for(i = 0; i < PGSIZE; i += n){
+    // the data blocks, unaligned, and the i-node.
+    begin_op(max/BSIZE + 2);
+    ilock(ip);
+    n = 0;
+    if(off + i < ip->size)
+      n = min(min(PGSIZE - i, ip->size - (off + i)), max);
+    if(n > 0 && writei(ip, 0, pa + i, off + i, n) != n)
+      n = 0;
+    iunlock(ip);
+    end_op();
+    if(n == 0)
+      break;
+  }
+}
+
+// Write the dirty pages of region v in [va, va+len) back to
+// the file, if v is a writable MAP_SHARED mapping of a file
+// opened for writing.
+static void
+vmasync(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  uint64 a;
+  pte_t *pte;
+
+  if(!vmawritable(v))
+    return;
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if(*pte & PTE_D)
+      writeback(v, a, PTE2PA(*pte));
+  }
+}
+
+// Unmap and free the pages in [va, va+len) that have been
+// faulted in.
+static void
+vmaunmap(struct proc *p, uint64 va, uint64 len)
+{
+  uint64 a, pa;
+  pte_t *pte;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    *pte = 0;
+    kfree((void*)pa);
+  }
+}
+
+// Release what an emptied region v refers to.
+static void
+vmaput(struct vma *v)
+{
+  if(v->f){
+    fileclose(v->f);
+    v->f = 0;
+  }
+  if(v->shm){
+    shmput(v->shm);
+    v->shm = 0;
+  }
+}
+
+// Remove the mappings for [addr, addr+len), which must lie
+// within a single region, and must be all of it for a shared
+// memory segment. Returns 0 on success, -1 on error.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v, *nv, old;
+  uint64 end;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+
+  // there is no cross-hart TLB shootdown, so another thread
+  // could go on using a page after it is freed. This also
+  // leaves the calling thread the only one that can change
+  // p->vma[] until it returns.
+  if(nthreads(p) > 1)
+    return -1;
+
+  if((v = findvma(p, addr)) == 0 || addr + len > v->addr + v->len)
+    return -1;
+  end = v->addr + v->len;
+  if(v->shm && (addr != v->addr || len != v->len))
+    return -1;
+
+  // writeback() sleeps, so do it before taking tlock.
+  vmasync(p, v, addr, len);
+
+  acquire(&p->tlock);
+  if(addr > v->addr && addr + len < end){
+    // a hole in the middle: the part above it becomes
+    // a region of its own.
+    nv = 0;
+    for(struct vma *w = p->vma; w < &p->vma[NVMA]; w++){
+      if(w->len == 0){
+        nv = w;
+        break;
+      }
+    }
+    if(nv == 0){
+      release(&p->tlock);
+      return -1;
+    }
+    *nv = *v;
+    nv->addr = addr + len;
+    nv->len = end - nv->addr;
+    nv->off = v->off + (nv->addr - v->addr);
+    if(nv->f)
+      filedup(nv->f);
+  }
+
+  vmaunmap(p, addr, len);
+
+  if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+    v->len -= len;
+  } else {
+    v->len = addr - v->addr;
+  }
+  // vmaput() sleeps, so free the slot now and release
+  // what it referred to after dropping tlock.
+  old = *v;
+  if(v->len == 0){
+    v->f = 0;
+    v->shm = 0;
+  }
+  release(&p->tlock);
+
+  if(old.len == 0)
+    vmaput(&old);
+  return 0;
+}
+
+// Remove all of p's regions, writing back dirty shared pages.
+// Called by exit() and exec().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    vmasync(p, v, v->addr, v->len);
+    vmaunmap(p, v->addr, v->len);
+    v->len = 0;
+    vmaput(v);
+  }
+}
+
+// Give fork()'s child np copies of p's regions. Pages of
+// MAP_SHARED regions are shared with the child; pages of
+// MAP_PRIVATE regions are copied. Returns 0 on success,
+// -1 on failure, in which case np is left with no regions.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+  uint64 a, pa;
+  pte_t *pte;
+  char *mem;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->len == 0)
+      continue;
+    *nv = *v;
+    if(nv->f)
+      filedup(nv->f);
+    if(nv->shm)
+      shmdup(nv->shm);
+    for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      pa = PTE2PA(*pte);
+      if(v->flags & MAP_SHARED){
+        kdup((void*)pa);
+        mem = (char*)pa;
+      } else {
+        if((mem = kalloc()) == 0)
+          goto err;
+        memmove(mem, (char*)pa, PGSIZE);
+      }
+      if(mappages(np->pagetable, a, PGSIZE, (uint64)mem, PTE_FLAGS(*pte)) != 0){
+        kfree(mem);
+        goto err;
+      }
+    }
+  }
+  return 0;
+
+ err:
+  // the parent still holds a reference to each file, so
+  // fileclose() won't need to sleep.
+  for(nv = np->vma; nv < &np->vma[NVMA]; nv++){
+    if(nv->len == 0)
+      continue;
+    vmaunmap(np, nv->addr, nv->len);
+    nv->len = 0;
+    vmaput(nv);
+  }
+  return -1;
+}
+
+// Handle a fault on user address va in pagetable, from a
+// user page fault or from copyin()/copyout(). If va lies in
+// one of the current process's regions and isn't mapped yet,
+// allocate its page, fill it from the file if there is one,
+// and map it. Returns 0 if the access can now be retried,
+// -1 if it is a genuine fault.
+int
+mmapfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+
+  if(p == 0 || p->pagetable != pagetable || va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((v = findvma(p, va)) == 0)
+    return -1;
+  if((v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return -1;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return -1;
+  // reading the file may sleep, which isn't allowed
+  // while holding a spinlock (e.g. copyout() in wait()),
+  // and locks the file's inode, which mustn't happen while
+  // fileread() or filewrite() holds one.
+  if(v->f && (intr_get() == 0 || myproc()->nofilefault))
+    return -1;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(v->f){
+    ilock(v->f->ip);
+    readi(v->f->ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+    iunlock(v->f->ip);
+  }
+  acquire(&p->tlock);
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    // another thread faulted it in first.
+    release(&p->tlock);
+    kfree(mem);
+    return 0;
+  }
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, vmaperm(v)) != 0){
+    release(&p->tlock);
+    kfree(mem);
+    return -1;
+  }
+  release(&p->tlock);
+  return 0;
+}
+
+// Fault in the pages of the current process's file-backed
+// regions in [va, va+n) that aren't mapped yet, so that
+// fileread() and filewrite() can copy to and from them once
+// they hold an inode lock, when mmapfault() can't read a file.
+void
+mmapprefault(uint64 va, int n, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, end;
+
+  if(n <= 0)
+    return;
+  for(v = p->leader->vma; v < &p->leader->vma[NVMA]; v++){
+    if(v->len == 0 || v->f == 0)
+      continue;
+    a = PGROUNDDOWN(va);
+    if(a < v->addr)
+      a = v->addr;
+    end = min(va + n, v->addr + v->len);
+    for(; a < end; a += PGSIZE)
+      mmapfault(p->pagetable, a, write);
+  }
+}
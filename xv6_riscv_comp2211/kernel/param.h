@@ -2,12 +2,19 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // i-nodes cached in memory before unused ones are recycled
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define MAXOPBLOCKS  10  // max # of blocks a namespace FS op writes
+#define IPUTBLOCKS    8  // max # of blocks iput() or a delayed-write flush writes
+#define LOGSIZE      (MAXOPBLOCKS*8)  // data blocks in the on-disk log mkfs makes
+#define NBUF         (MAXOPBLOCKS*20)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NSUPERPG     16    // 2 MiB superpages set aside for large user heaps
+#define NVMA         16    // mmap() regions per process
+#define NTHREAD       8    // threads per process
+#define NSHM         16    // shared memory segments per system
+#define NSHMPG       32    // max pages in a shared memory segment
+#define POLLTIME     500   // timer cycles to spin on single-block disk I/O; 0 to always sleep
@@ -53,6 +53,7 @@ procinit(void)
   initlock(&wait_lock, "wait_lock");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
+      initlock(&p->tlock, "tlock");
       p->state = UNUSED;
       p->kstack = KSTACK((int) (p - proc));
   }
@@ -104,10 +105,12 @@ allocpid()
 
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. Unless thread is set, also
+// give it an empty user page table, making it the leader of
+// a new process; clone() fills in a thread's page table.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(int thread)
 {
   struct proc *p;
 
@@ -132,14 +135,20 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
+  if(!thread){
+    // An empty user page table.
+    p->pagetable = proc_pagetable(p);
+    if(p->pagetable == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->leader = p;
+    p->tfva = TRAPFRAME;
   }
 
+  memset(p->vma, 0, sizeof(p->vma));
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -158,12 +167,23 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
+  if(p->pagetable && p->leader == p)
     proc_freepagetable(p->pagetable, p->sz);
+  else if(p->pagetable){
+    // a thread: the other threads may be changing the
+    // page table they share with it.
+    acquire(&p->leader->tlock);
+    uvmunmap(p->pagetable, p->tfva, 1, 0);
+    release(&p->leader->tlock);
+  }
   p->pagetable = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
+  p->leader = 0;
+  p->tfva = 0;
+  p->ustack = 0;
+  p->kfn = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
@@ -234,7 +254,7 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy initcode's instructions
@@ -260,17 +280,33 @@ int
 growproc(int n)
 {
   uint64 sz;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
+
+  // there is no cross-hart TLB shootdown, so another thread
+  // could go on using a page after it is freed.
+  if(n < 0 && nthreads(p) > 1)
+    return -1;
 
+  acquire(&p->tlock);
   sz = p->sz;
   if(n > 0){
+    if(sz + n > mmapbase(p)){
+      release(&p->tlock);
+      return -1;
+    }
     if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+      release(&p->tlock);
       return -1;
     }
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if((sz = uvmdealloc(p->pagetable, sz, sz + n)) == p->sz){
+      // out of memory to split a megapage, or n too big.
+      release(&p->tlock);
+      return -1;
+    }
   }
   p->sz = sz;
+  release(&p->tlock);
   return 0;
 }
 
@@ -282,19 +318,30 @@ fork(void)
   int i, pid;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *l = p->leader;
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Only the calling thread is copied.
+  acquire(&l->tlock);
+  if(uvmcopy(l->pagetable, np->pagetable, l->sz) < 0){
+    release(&l->tlock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  // freeproc() must free what uvmcopy() mapped if mmapcopy() fails.
+  np->sz = l->sz;
+  release(&l->tlock);
+  if(mmapcopy(l, np) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -303,10 +350,13 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
+  // other threads may be opening and closing them.
+  acquire(&l->tlock);
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+    if(l->ofile[i])
+      np->ofile[i] = filedup(l->ofile[i]);
+  np->cwd = idup(l->cwd);
+  release(&l->tlock);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -325,7 +375,81 @@ fork(void)
   return pid;
 }
 
-// Pass p's abandoned children to init.
+// Create a child process running the program at path with
+// arguments argv, without copying the caller's memory as
+// fork() followed by exec() would. The child's descriptor i
+// is a duplicate of the caller's descriptor fds[i], or closed
+// if fds[i] is -1, for i < nfds; it gets no other descriptors.
+// If fds is 0, the child inherits all of them instead.
+// Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, int *fds, int nfds)
+{
+  int i, argc, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+
+  if(nfds < 0 || nfds > NOFILE)
+    return -1;
+  if(fds){
+    for(i = 0; i < nfds; i++)
+      if(fds[i] < -1 || fds[i] >= NOFILE)
+        return -1;
+  }
+
+  if((np = allocproc(0)) == 0)
+    return -1;
+  // np is USED, so it won't run, but execinto() may sleep.
+  release(&np->lock);
+
+  // other threads may be opening and closing descriptors.
+  acquire(&l->tlock);
+  for(i = 0; i < NOFILE; i++){
+    if(fds && i < nfds && fds[i] >= 0){
+      if(l->ofile[fds[i]] == 0)
+        break;
+      np->ofile[i] = filedup(l->ofile[fds[i]]);
+    } else if(fds == 0 && l->ofile[i])
+      np->ofile[i] = filedup(l->ofile[i]);
+  }
+  np->cwd = idup(l->cwd);
+  release(&l->tlock);
+
+  if(i < NOFILE || (argc = execinto(np, path, argv)) < 0){
+    for(i = 0; i < NOFILE; i++){
+      if(np->ofile[i]){
+        fileclose(np->ofile[i]);
+        np->ofile[i] = 0;
+      }
+    }
+    begin_op(IPUTBLOCKS);
+    iput(np->cwd);
+    end_op();
+    np->cwd = 0;
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  // main(argc, argv); execinto() has set a1.
+  np->trapframe->a0 = argc;
+
+  pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  return pid;
+}
+
+// Pass p's abandoned children to init, and any
+// threads it created to its leader.
 // Caller must hold wait_lock.
 void
 reparent(struct proc *p)
@@ -333,13 +457,136 @@ reparent(struct proc *p)
   struct proc *pp;
 
   for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
+    if(pp->parent == p && pp->leader != pp){
+      pp->parent = p->leader;
+      wakeup(p->leader);
+    } else if(pp->parent == p){
       pp->parent = initproc;
       wakeup(initproc);
     }
   }
 }
 
+// Kill the other threads of p, a leader, and wait for them
+// to exit, so that what they share with p can be released.
+static void
+killthreads(struct proc *p)
+{
+  struct proc *pp;
+  int found;
+
+  acquire(&wait_lock);
+  for(;;){
+    found = 0;
+    for(pp = proc; pp < &proc[NPROC]; pp++){
+      if(pp->leader != p || pp == p)
+        continue;
+      acquire(&pp->lock);
+      if(pp->state == ZOMBIE){
+        freeproc(pp);
+      } else {
+        found = 1;
+        pp->killed = 1;
+        if(pp->state == SLEEPING)
+          pp->state = RUNNABLE;
+      }
+      release(&pp->lock);
+    }
+    if(!found)
+      break;
+    // exiting threads wake their leader.
+    sleep(p, &wait_lock);
+  }
+  release(&wait_lock);
+}
+
+// Return the number of threads in p's process, counting
+// those that have exited but not been joined.
+int
+nthreads(struct proc *p)
+{
+  struct proc *pp;
+  int n = 0;
+
+  acquire(&wait_lock);
+  for(pp = proc; pp < &proc[NPROC]; pp++){
+    if(pp->leader == p->leader)
+      n++;
+  }
+  release(&wait_lock);
+  return n;
+}
+
+// Create a new thread in the current process that runs
+// fn(arg) on the user stack [stack, stack+size). It shares
+// the page table, open files and current directory with the
+// process's other threads, but has its own kernel stack and
+// a trapframe mapped at its own address below TRAPFRAME.
+// fn must not return; it should call exit().
+// Returns the new thread's pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack, uint64 size)
+{
+  int slot, pid;
+  uint used;
+  struct proc *np, *pp;
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+
+  if(stack + size < stack || stack + size > MAXVA)
+    return -1;
+
+  if((np = allocproc(1)) == 0)
+    return -1;
+  release(&np->lock);
+
+  acquire(&wait_lock);
+
+  // pick a free trapframe slot; slot 0 is the leader's.
+  used = 1;
+  for(pp = proc; pp < &proc[NPROC]; pp++){
+    if(pp->leader == l && pp != l)
+      used |= 1 << ((TRAPFRAME - pp->tfva) / PGSIZE);
+  }
+  for(slot = 0; slot < NTHREAD && (used & (1 << slot)); slot++)
+    ;
+  acquire(&l->tlock);
+  if(slot == NTHREAD ||
+     mappages(l->pagetable, TTRAPFRAME(slot), PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    release(&l->tlock);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    release(&wait_lock);
+    return -1;
+  }
+  release(&l->tlock);
+
+  np->pagetable = l->pagetable;
+  np->leader = l;
+  np->tfva = TTRAPFRAME(slot);
+  np->ustack = stack;
+  np->parent = p;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = (stack + size) & ~0xfL;
+  np->trapframe->a0 = arg;
+  np->trapframe->ra = 0;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  pid = np->pid;
+
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  return pid;
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait().
@@ -351,27 +598,41 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
+  // A thread other than the leader leaves the shared memory,
+  // files and directory alone. The leader takes the other
+  // threads with it, then releases them.
+  if(p->leader == p){
+    killthreads(p);
+
+    // Unmap mmap() regions, writing back shared file pages.
+    munmapall(p);
+
+    // Close all open files.
+    for(int fd = 0; fd < NOFILE; fd++){
+      if(p->ofile[fd]){
+        struct file *f = p->ofile[fd];
+        fileclose(f);
+        p->ofile[fd] = 0;
+      }
     }
-  }
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+    begin_op(IPUTBLOCKS);
+    iput(p->cwd);
+    end_op();
+    p->cwd = 0;
+  }
 
   acquire(&wait_lock);
 
   // Give any children to init.
   reparent(p);
 
-  // Parent might be sleeping in wait().
+  // Parent might be sleeping in wait() or join().
   wakeup(p->parent);
+
+  // The leader might be sleeping in killthreads().
+  if(p->leader != p)
+    wakeup(p->leader);
   
   acquire(&p->lock);
 
@@ -400,7 +661,7 @@ wait(uint64 addr)
     // Scan through table looking for exited children.
     havekids = 0;
     for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
+      if(pp->parent == p && pp->leader == pp){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
 
@@ -434,6 +695,52 @@ wait(uint64 addr)
   }
 }
 
+// Wait for a thread created by this thread with clone() to
+// exit, and return its pid. Copy the stack that was passed
+// to clone() to addr, so the caller can free it.
+// Return -1 if this thread has no such threads.
+int
+join(uint64 addr)
+{
+  struct proc *pp;
+  int havethreads, pid;
+  struct proc *p = myproc();
+
+  acquire(&wait_lock);
+
+  for(;;){
+    havethreads = 0;
+    for(pp = proc; pp < &proc[NPROC]; pp++){
+      if(pp->parent == p && pp->leader != pp){
+        acquire(&pp->lock);
+
+        havethreads = 1;
+        if(pp->state == ZOMBIE){
+          pid = pp->pid;
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->ustack,
+                                  sizeof(pp->ustack)) < 0) {
+            release(&pp->lock);
+            release(&wait_lock);
+            return -1;
+          }
+          freeproc(pp);
+          release(&pp->lock);
+          release(&wait_lock);
+          return pid;
+        }
+        release(&pp->lock);
+      }
+    }
+
+    if(!havethreads || killed(p)){
+      release(&wait_lock);
+      return -1;
+    }
+
+    sleep(p, &wait_lock);
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -509,6 +816,38 @@ yield(void)
   release(&p->lock);
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthread returned");
+}
+
+// Start a process that runs fn() in the kernel, forever,
+// and never returns to user space. Returns its pid, or -1.
+int
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+  int pid;
+
+  if((p = allocproc(0)) == 0)
+    return -1;
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  pid = p->pid;
+  p->state = RUNNABLE;
+  release(&p->lock);
+  return pid;
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -81,6 +81,18 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of user memory created by mmap().
+// Its pages are allocated when first touched; see mmapfault().
+struct vma {
+  uint64 addr;                 // Start, page-aligned
+  uint64 len;                  // Length in bytes, page-aligned; 0 if unused
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE, MAP_ANONYMOUS
+  struct file *f;              // Mapped file, or 0 if anonymous
+  uint64 off;                  // File offset corresponding to addr
+  struct shm *shm;             // Shared memory segment, or 0
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -95,13 +107,29 @@ struct proc {
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
-  // these are private to the process, so p->lock need not be held.
+  // these are set when the thread is created and don't change
+  // until it is freed, so a thread may read its own without a
+  // lock; wait_lock must be held to read another thread's.
+  struct proc *leader;         // First thread of this process, maybe p itself
+  uint64 tfva;                 // User virtual address of trapframe
+  uint64 ustack;               // User stack passed to clone(), for join()
+
+  // these are private to the thread, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  pagetable_t pagetable;       // User page table, shared by all threads
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
+  char name[16];               // Process name (debugging)
+  int logres;                  // Log blocks reserved by begin_op() and not yet used
+  int nofilefault;             // Copying under an inode lock; see mmapfault()
+  void (*kfn)(void);           // Function a kernel thread runs
+
+  // these are shared by all threads, and only the leader's are used.
+  // tlock must be held to change these or the page table, and
+  // to take a reference to an ofile[] entry or to cwd.
+  struct spinlock tlock;
+  uint64 sz;                   // Size of process memory (bytes)
   struct file *ofile[NOFILE];  // Open files
+  struct vma vma[NVMA];        // mmap() regions
   struct inode *cwd;           // Current directory
-  char name[16];               // Process name (debugging)
 };
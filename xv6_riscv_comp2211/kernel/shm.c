@@ -0,0 +1,170 @@
+//
+// Shared memory segments: shmget(), shmat() and shmdt().
+//
+// A segment is a set of zeroed physical pages named by a key.
+// shmat() maps all of its pages into the calling process as a
+// MAP_SHARED region (see mmap.c), taking a reference on each
+// page, so attached processes see each other's stores with no
+// copying through the kernel. fork() gives the child its own
+// attachment. A segment's pages are freed when its last
+// attachment goes away; a segment that has never been attached
+// stays until it is.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fcntl.h"
+
+struct shm {
+  int key;
+  int npages;                  // 0 if this slot is unused
+  int ref;                     // number of attachments
+  uint64 pages[NSHMPG];        // physical addresses
+};
+
+struct {
+  struct spinlock lock;
+  struct shm seg[NSHM];
+} shmtab;
+
+void
+shminit(void)
+{
+  initlock(&shmtab.lock, "shm");
+}
+
+// Return the id of the segment named key, creating it with
+// at least size bytes if it doesn't exist. Returns -1 if
+// size is too large, or larger than an existing segment.
+int
+shmget(int key, uint64 size)
+{
+  struct shm *s, *free;
+  int i, npages;
+
+  npages = PGROUNDUP(size) / PGSIZE;
+  if(npages == 0 || npages > NSHMPG)
+    return -1;
+
+  acquire(&shmtab.lock);
+  free = 0;
+  for(s = shmtab.seg; s < &shmtab.seg[NSHM]; s++){
+    if(s->npages > 0 && s->key == key){
+      release(&shmtab.lock);
+      if(npages > s->npages)
+        return -1;
+      return s - shmtab.seg;
+    }
+    if(s->npages == 0 && free == 0)
+      free = s;
+  }
+  if((s = free) == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+  for(i = 0; i < npages; i++){
+    if((s->pages[i] = (uint64)kalloc()) == 0){
+      while(--i >= 0)
+        kfree((void*)s->pages[i]);
+      release(&shmtab.lock);
+      return -1;
+    }
+    memset((void*)s->pages[i], 0, PGSIZE);
+  }
+  s->key = key;
+  s->npages = npages;
+  s->ref = 0;
+  release(&shmtab.lock);
+  return s - shmtab.seg;
+}
+
+// Take another attachment on s, for fork().
+void
+shmdup(struct shm *s)
+{
+  acquire(&shmtab.lock);
+  if(s->ref < 1)
+    panic("shmdup");
+  s->ref++;
+  release(&shmtab.lock);
+}
+
+// Drop an attachment on s, freeing its pages if it was the last.
+void
+shmput(struct shm *s)
+{
+  int i;
+
+  acquire(&shmtab.lock);
+  if(s->ref < 1)
+    panic("shmput");
+  if(--s->ref == 0){
+    for(i = 0; i < s->npages; i++)
+      kfree((void*)s->pages[i]);
+    s->npages = 0;
+  }
+  release(&shmtab.lock);
+}
+
+// Map segment id into the current process.
+// Returns the address of the mapping, or -1.
+uint64
+shmat(int id)
+{
+  struct proc *p = myproc()->leader;
+  struct shm *s;
+  struct vma *v;
+  uint64 a;
+  int i;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shmtab.seg[id];
+  acquire(&shmtab.lock);
+  if(s->npages == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+  s->ref++;
+  release(&shmtab.lock);
+
+  if((v = vmaalloc(p, (uint64)s->npages * PGSIZE)) == 0){
+    shmput(s);
+    return -1;
+  }
+  v->prot = PROT_READ | PROT_WRITE;
+  v->flags = MAP_SHARED;
+  v->shm = s;
+
+  for(i = 0; i < s->npages; i++){
+    a = v->addr + (uint64)i * PGSIZE;
+    acquire(&p->tlock);
+    if(mappages(p->pagetable, a, PGSIZE, s->pages[i], PTE_R|PTE_W|PTE_U) != 0){
+      release(&p->tlock);
+      munmap(v->addr, v->len);
+      return -1;
+    }
+    kdup((void*)s->pages[i]);
+    release(&p->tlock);
+  }
+  return v->addr;
+}
+
+// Detach the segment mapped at addr from the current process.
+int
+shmdt(uint64 addr)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && v->shm && v->addr == addr)
+      return munmap(v->addr, v->len);
+  }
+  return -1;
+}
@@ -11,7 +11,7 @@
 int
 fetchaddr(uint64 addr, uint64 *ip)
 {
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
   if(addr >= p->sz || addr+sizeof(uint64) > p->sz) // both tests needed, in case of overflow
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
@@ -101,6 +101,19 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_shmget(void);
+extern uint64 sys_shmat(void);
+extern uint64 sys_shmdt(void);
+extern uint64 sys_futexwait(void);
+extern uint64 sys_futexwake(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_fruns(void);
+extern uint64 sys_blkstat(void);
+extern uint64 sys_bcstat(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -126,6 +139,19 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_shmget]  sys_shmget,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_futexwait] sys_futexwait,
+[SYS_futexwake] sys_futexwake,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_spawn]   sys_spawn,
+[SYS_fruns]   sys_fruns,
+[SYS_blkstat] sys_blkstat,
+[SYS_bcstat]  sys_bcstat,
 };
 
 void
@@ -20,3 +20,16 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_shmget 24
+#define SYS_shmat  25
+#define SYS_shmdt  26
+#define SYS_futexwait 27
+#define SYS_futexwake 28
+#define SYS_clone  29
+#define SYS_join   30
+#define SYS_spawn  31
+#define SYS_fruns  32
+#define SYS_blkstat 33
+#define SYS_bcstat 34
@@ -15,22 +15,32 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "blkstat.h"
+#include "bcstat.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// Another thread may close the descriptor at any time, so *pf is a
+// new reference that the caller must fileclose().
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
   int fd;
   struct file *f;
+  struct proc *p = myproc()->leader;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
+    return -1;
+  acquire(&p->tlock);
+  if((f = p->ofile[fd]) != 0)
+    filedup(f);
+  release(&p->tlock);
+  if(f == 0)
     return -1;
   if(pfd)
     *pfd = fd;
-  if(pf)
-    *pf = f;
+  *pf = f;
   return 0;
 }
 
@@ -40,17 +50,38 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
+  acquire(&p->tlock);
   for(fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd] == 0){
       p->ofile[fd] = f;
+      release(&p->tlock);
       return fd;
     }
   }
+  release(&p->tlock);
   return -1;
 }
 
+// Free file descriptor fd if it still refers to f; another
+// thread may have closed it already. Returns 0 if it did,
+// in which case the caller owns the descriptor's reference.
+static int
+fdfree(int fd, struct file *f)
+{
+  struct proc *p = myproc()->leader;
+
+  acquire(&p->tlock);
+  if(p->ofile[fd] != f){
+    release(&p->tlock);
+    return -1;
+  }
+  p->ofile[fd] = 0;
+  release(&p->tlock);
+  return 0;
+}
+
 uint64
 sys_dup(void)
 {
@@ -59,9 +90,10 @@ sys_dup(void)
 
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -69,21 +101,23 @@ uint64
 sys_read(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   uint64 p;
 
   argaddr(1, &p);
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 uint64
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   uint64 p;
   
   argaddr(1, &p);
@@ -91,20 +125,23 @@ sys_write(void)
   if(argfd(0, 0, &f) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  r = filewrite(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 uint64
 sys_close(void)
 {
-  int fd;
+  int fd, r;
   struct file *f;
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  if((r = fdfree(fd, f)) == 0)
+    fileclose(f);  // the descriptor's reference
   fileclose(f);
-  return 0;
+  return r;
 }
 
 uint64
@@ -112,11 +149,29 @@ sys_fstat(void)
 {
   struct file *f;
   uint64 st; // user pointer to struct stat
+  int r;
 
   argaddr(1, &st);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fileclose(f);
+  return r;
+}
+
+// Return the number of runs of contiguous disk blocks the
+// file occupies.
+uint64
+sys_fruns(void)
+{
+  struct file *f;
+  int r;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  r = fileruns(f);
+  fileclose(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -129,7 +184,7 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op(MAXOPBLOCKS);
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -196,7 +251,7 @@ sys_unlink(void)
   if(argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op(MAXOPBLOCKS);
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -222,6 +277,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcacheenter(dp->dev, dp->inum, name, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -314,7 +370,7 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0)
     return -1;
 
-  begin_op();
+  begin_op(MAXOPBLOCKS);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -376,7 +432,7 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_op(MAXOPBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -393,7 +449,7 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_op(MAXOPBLOCKS);
   argint(1, &major);
   argint(2, &minor);
   if((argstr(0, path, MAXPATH)) < 0 ||
@@ -410,10 +466,10 @@ uint64
 sys_chdir(void)
 {
   char path[MAXPATH];
-  struct inode *ip;
-  struct proc *p = myproc();
+  struct inode *ip, *old;
+  struct proc *p = myproc()->leader;
   
-  begin_op();
+  begin_op(IPUTBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
@@ -425,26 +481,38 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
-  end_op();
+  // other threads may be looking up paths relative to cwd.
+  acquire(&p->tlock);
+  old = p->cwd;
   p->cwd = ip;
+  release(&p->tlock);
+  iput(old);
+  end_op();
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Free the strings of an argv[MAXARG] from fetchargv().
+static void
+freeargv(char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// Copy the user argv array at uargv into argv[MAXARG],
+// one kalloc()ed page per string.
+// Returns 0, or -1 with nothing left allocated.
+static int
+fetchargv(uint64 uargv, char **argv)
+{
+  int i;
+  uint64 uarg;
+
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -460,18 +528,55 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
 
-  int ret = exec(path, argv);
+ bad:
+  freeargv(argv);
+  return -1;
+}
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
 
+  int ret = exec(path, argv);
+
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  int fds[NOFILE], nfds;
+  uint64 uargv, ufds;
+
+  argaddr(1, &uargv);
+  argaddr(2, &ufds);
+  argint(3, &nfds);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  if(nfds < 0 || nfds > NOFILE)
+    return -1;
+  if(ufds && copyin(myproc()->pagetable, (char*)fds, ufds, nfds*sizeof(int)) < 0)
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = spawn(path, argv, ufds ? fds : 0, nfds);
+
+  freeargv(argv);
+  return ret;
 }
 
 uint64
@@ -480,26 +585,83 @@ sys_pipe(void)
   uint64 fdarray; // user pointer to array of two integers
   struct file *rf, *wf;
   int fd0, fd1;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
   argaddr(0, &fdarray);
   if(pipealloc(&rf, &wf) < 0)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      p->ofile[fd0] = 0;
-    fileclose(rf);
+    if(fd0 < 0 || fdfree(fd0, rf) == 0)
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
-    fileclose(rf);
-    fileclose(wf);
+    if(fdfree(fd0, rf) == 0)
+      fileclose(rf);
+    if(fdfree(fd1, wf) == 0)
+      fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, off, r;
+  int prot, flags;
+  struct file *f = 0;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  r = mmap(addr, len, prot, flags, f, off);
+  if(f)
+    fileclose(f);
+  return r;
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
+
+// Copy the block request queue's statistics to user memory.
+uint64
+sys_blkstat(void)
+{
+  uint64 addr; // user pointer to struct blkstat
+  struct blkstat st;
+
+  argaddr(0, &addr);
+  blkstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// Copy the buffer cache's statistics to user memory.
+uint64
+sys_bcstat(void)
+{
+  uint64 addr; // user pointer to struct bcstat
+  struct bcstat st;
+
+  argaddr(0, &addr);
+  bcstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
@@ -42,7 +42,7 @@ sys_sbrk(void)
   int n;
 
   argint(0, &n);
-  addr = myproc()->sz;
+  addr = myproc()->leader->sz;
   if(growproc(n) < 0)
     return -1;
   return addr;
@@ -89,3 +89,79 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+uint64
+sys_shmget(void)
+{
+  int key, size;
+
+  argint(0, &key);
+  argint(1, &size);
+  if(size < 0)
+    return -1;
+  return shmget(key, size);
+}
+
+uint64
+sys_shmat(void)
+{
+  int id;
+
+  argint(0, &id);
+  return shmat(id);
+}
+
+uint64
+sys_shmdt(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return shmdt(addr);
+}
+
+uint64
+sys_futexwait(void)
+{
+  uint64 addr;
+  int val;
+
+  argaddr(0, &addr);
+  argint(1, &val);
+  return futexwait(addr, val);
+}
+
+uint64
+sys_futexwake(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return futexwake(addr, n);
+}
+
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+  int size;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  argint(3, &size);
+  if(size <= 0)
+    return -1;
+  return clone(fn, arg, stack, size);
+}
+
+uint64
+sys_join(void)
+{
+  uint64 p;
+
+  argaddr(0, &p);
+  return join(p);
+}
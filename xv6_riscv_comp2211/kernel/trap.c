@@ -67,6 +67,20 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // instruction, load or store page fault: perhaps the first
+    // touch of a page in an mmap() region.
+    uint64 scause = r_scause();
+    uint64 va = r_stval();
+
+    // faulting in a file page may sleep.
+    intr_on();
+
+    if(mmapfault(p->pagetable, va, scause == 15) != 0){
+      printf("usertrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, va);
+      setkilled(p);
+    }
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -126,7 +140,7 @@ usertrapret(void)
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, p->tfva);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -189,7 +203,7 @@ devintr()
     if(irq == UART0_IRQ){
       uartintr();
     } else if(irq == VIRTIO0_IRQ){
-      virtio_disk_intr();
+      blkintr();
     } else if(irq){
       printf("unexpected interrupt irq=%d\n", irq);
     }
@@ -29,6 +29,7 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -47,7 +48,18 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 32
+
+// offset of num_queues in a block device's configuration,
+// valid with VIRTIO_BLK_F_MQ.
+#define VIRTIO_BLK_CFG_NUM_QUEUES 34
+
+// most virtqueues used.
+#define NVQ 8
+
+// most blocks in one disk request, each with a data
+// descriptor of its own. qemu allows many more (seg_max).
+#define MAXSEG 8
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -61,11 +73,12 @@ struct virtq_desc {
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_AVAIL_F_NO_INTERRUPT, without EVENT_IDX
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // with EVENT_IDX: interrupt once used idx passes this
 };
+#define VRING_AVAIL_F_NO_INTERRUPT 1
 
 // one entry in the "used" ring, with which the
 // device tells the driver about completed requests.
@@ -75,10 +88,12 @@ struct virtq_used_elem {
 };
 
 struct virtq_used {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_USED_F_NO_NOTIFY, without EVENT_IDX
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // with EVENT_IDX: notify once avail idx passes this
 };
+#define VRING_USED_F_NO_NOTIFY 1
 
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
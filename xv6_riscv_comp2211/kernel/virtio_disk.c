@@ -4,6 +4,12 @@
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// if the device offers VIRTIO_BLK_F_MQ, the driver uses up to
+// NVQ virtqueues, each with its own lock, so that harts issuing
+// disk requests at the same time (blkq.c gives each hart a queue)
+// don't contend. the mmio transport has one interrupt for all
+// of them.
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -19,7 +25,10 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// one virtqueue.
+struct vq {
+  struct spinlock lock;
+
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -41,37 +50,90 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  int quiet;       // asked the device not to interrupt?
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b[MAXSEG];
+    int n;
     char status;
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
-  
-  struct spinlock vdisk_lock;
-  
+};
+
+static struct disk {
+  int event_idx;   // negotiated VIRTIO_RING_F_EVENT_IDX?
+  int nvq;         // virtqueues in use
+  struct vq vq[NVQ];
 } disk;
 
+// set up virtqueue i.
+static void
+vqinit(int i)
+{
+  struct vq *vq = &disk.vq[i];
+
+  initlock(&vq->lock, "virtio_disk");
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = i;
+
+  // ensure the queue is not in use.
+  if(*R(VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
+
+  // check maximum queue size.
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  vq->desc = kalloc();
+  vq->avail = kalloc();
+  vq->used = kalloc();
+  if(!vq->desc || !vq->avail || !vq->used)
+    panic("virtio disk kalloc");
+  memset(vq->desc, 0, PGSIZE);
+  memset(vq->avail, 0, PGSIZE);
+  memset(vq->used, 0, PGSIZE);
+
+  // set queue size.
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // write physical addresses.
+  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)vq->desc;
+  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)vq->desc >> 32;
+  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)vq->avail;
+  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)vq->avail >> 32;
+  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)vq->used;
+  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)vq->used >> 32;
+
+  // queue is ready.
+  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for(int j = 0; j < NUM; j++)
+    vq->free[j] = 1;
+}
+
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 2 ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
      *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
     panic("could not find virtio disk");
   }
-  
+
   // reset device
   *R(VIRTIO_MMIO_STATUS) = status;
 
@@ -88,11 +150,10 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -103,47 +164,17 @@ virtio_disk_init(void)
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
+  // how many virtqueues?
+  disk.nvq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ))
+    disk.nvq = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_NUM_QUEUES);
+  if(disk.nvq > NVQ)
+    disk.nvq = NVQ;
+  if(disk.nvq < 1)
+    panic("virtio disk has no queues");
 
-  // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
-
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  for(int i = 0; i < disk.nvq; i++)
+    vqinit(i);
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -152,13 +183,20 @@ virtio_disk_init(void)
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
+// how many virtqueues the driver uses.
+int
+virtio_disk_nqueue(void)
+{
+  return disk.nvq;
+}
+
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vq *vq)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(vq->free[i]){
+      vq->free[i] = 0;
       return i;
     }
   }
@@ -167,28 +205,27 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vq *vq, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(vq->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  vq->desc[i].addr = 0;
+  vq->desc[i].len = 0;
+  vq->desc[i].flags = 0;
+  vq->desc[i].next = 0;
+  vq->free[i] = 1;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vq *vq, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = vq->desc[i].flags;
+    int nxt = vq->desc[i].next;
+    free_desc(vq, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -196,46 +233,49 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct vq *vq, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(vq);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(vq, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
+// Start one request on virtqueue q reading or writing the n
+// buffers in bs, which hold adjacent blocks, and return without
+// waiting. virtio_disk_poll() calls blkdone() when it has
+// finished. blkq.c never gives a queue more requests than it
+// has descriptors for.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_start(int q, struct buf **bs, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  struct vq *vq = &disk.vq[q];
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
+  int i;
 
-  acquire(&disk.vdisk_lock);
+  // the spec's Section 5.2 says that block operations use a
+  // descriptor for type/reserved/sector, descriptors for the
+  // data, and one for a 1-byte status result. each buffer
+  // gets a data descriptor of its own (scatter-gather).
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  acquire(&vq->lock);
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
+  // allocate the descriptors.
+  int idx[MAXSEG+2];
+  if(n < 1 || n > MAXSEG || alloc_descs(vq, idx, n+2) != 0)
+    panic("virtio_disk_start");
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &vq->ops[idx[0]];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -244,84 +284,136 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  vq->desc[idx[0]].addr = (uint64) buf0;
+  vq->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  vq->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  vq->desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 0; i < n; i++){
+    vq->desc[idx[1+i]].addr = (uint64) bs[i]->data;
+    vq->desc[idx[1+i]].len = BSIZE;
+    if(write)
+      vq->desc[idx[1+i]].flags = 0; // device reads b->data
+    else
+      vq->desc[idx[1+i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    vq->desc[idx[1+i]].flags |= VRING_DESC_F_NEXT;
+    vq->desc[idx[1+i]].next = idx[2+i];
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  vq->info[idx[0]].status = 0xff; // device writes 0 on success
+  vq->desc[idx[n+1]].addr = (uint64) &vq->info[idx[0]].status;
+  vq->desc[idx[n+1]].len = 1;
+  vq->desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  vq->desc[idx[n+1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the bufs for reap().
+  for(i = 0; i < n; i++)
+    vq->info[idx[0]].b[i] = bs[i];
+  vq->info[idx[0]].n = n;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  vq->avail->ring[vq->avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  uint16 old = vq->avail->idx;
+  vq->avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
-
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  // a device that is still working through the avail ring
+  // will find this request without being told.
+  if(disk.event_idx){
+    if((uint16)(vq->avail->idx - vq->used->avail_event - 1) <
+       (uint16)(vq->avail->idx - old))
+      *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q; // value is queue number
+  } else if((vq->used->flags & VRING_USED_F_NO_NOTIFY) == 0){
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q;
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
-  release(&disk.vdisk_lock);
+  release(&vq->lock);
 }
 
+// Ask the device to interrupt when it finishes a request on
+// virtqueue q (on), or not to (off), as while blkq.c polls.
 void
-virtio_disk_intr()
+virtio_disk_intrs(int q, int on)
 {
-  acquire(&disk.vdisk_lock);
-
-  // the device won't raise another interrupt until we tell it
-  // we've seen this interrupt, which the following line does.
-  // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
-  // completion entries in this interrupt, and have nothing to do
-  // in the next interrupt, which is harmless.
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
-
+  struct vq *vq = &disk.vq[q];
+
+  acquire(&vq->lock);
+  vq->quiet = !on;
+  if(disk.event_idx){
+    // off: not until used idx comes round again.
+    vq->avail->used_event = on ? vq->used_idx : vq->used_idx - 1;
+  } else {
+    vq->avail->flags = on ? 0 : VRING_AVAIL_F_NO_INTERRUPT;
+  }
   __sync_synchronize();
+  release(&vq->lock);
+}
 
-  // the device increments disk.used->idx when it
+// Hand each request the device has finished to blkdone().
+// Caller holds vq->lock.
+static void
+reap(int q, struct vq *vq)
+{
+again:
+  // the device increments vq->used->idx when it
   // adds an entry to the used ring.
 
-  while(disk.used_idx != disk.used->idx){
+  while(vq->used_idx != vq->used->idx){
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = vq->used->ring[vq->used_idx % NUM].id;
 
-    if(disk.info[id].status != 0)
+    if(vq->info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    blkdone(q, vq->info[id].b, vq->info[id].n);
+    vq->info[id].n = 0;
+    free_chain(vq, id);
 
-    disk.used_idx += 1;
+    vq->used_idx += 1;
   }
 
-  release(&disk.vdisk_lock);
+  // with EVENT_IDX, the device interrupts only as it passes
+  // used_event: ask for the next request to finish, unless
+  // blkq.c is polling. completions while the interrupt is
+  // handled share it.
+  if(disk.event_idx && !vq->quiet){
+    vq->avail->used_event = vq->used_idx;
+    __sync_synchronize();
+    // one may have finished before the device saw that.
+    if(vq->used_idx != vq->used->idx)
+      goto again;
+  }
+}
+
+// Look for finished requests on virtqueue q. Called by blkq.c,
+// holding that queue's lock, when polling and after an interrupt.
+void
+virtio_disk_poll(int q)
+{
+  struct vq *vq = &disk.vq[q];
+
+  acquire(&vq->lock);
+  __sync_synchronize();
+  reap(q, vq);
+  release(&vq->lock);
+}
+
+// Called by blkintr(), which then polls each virtqueue.
+void
+virtio_disk_intr()
+{
+  // the device won't raise another interrupt until we tell it
+  // we've seen this interrupt, which the following line does.
+  // this may race with the device writing new entries to
+  // the "used" rings, in which case we may process the new
+  // completion entries in this interrupt, and have nothing to do
+  // in the next interrupt, which is harmless.
+  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+  __sync_synchronize();
 }
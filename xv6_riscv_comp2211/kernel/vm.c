@@ -37,6 +37,7 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // mappages() uses megapages for the 2 MiB-aligned bulk of it.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -82,15 +83,34 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A valid leaf PTE may sit above level 0 (a megapage);
+// walk() returns it rather than walking through it.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0, 0);
+}
+
+// Like walk(), but stop at the PTE for va in the page-table
+// page at the given level (0 for a 4096-byte page, 1 for a
+// megapage). Also stops early at a leaf PTE found above that
+// level. If plevel!=0, sets *plevel to the level of the
+// returned PTE.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int level, int *plevel)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte)){
+        if(plevel)
+          *plevel = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -99,7 +119,9 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  if(plevel)
+    *plevel = level;
+  return &pagetable[PX(level, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -110,11 +132,12 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
@@ -122,6 +145,8 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  // within a megapage, find the 4096-byte page holding va.
+  pa += PGROUNDDOWN(va) & (PXSIZE(level) - 1);
   return pa;
 }
 
@@ -137,13 +162,16 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
-// allocate a needed page-table page.
+// be page-aligned. Wherever va and pa are both megapage-aligned
+// and at least a megapage remains, a single level-1 leaf PTE
+// maps the whole megapage. Returns 0 on success, -1 if walk()
+// couldn't allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
+  int level;
 
   if(size == 0)
     panic("mappages: size");
@@ -151,44 +179,109 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    if(a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+       last - a >= SUPERPGSIZE - PGSIZE){
+      level = 1;
+      sz = SUPERPGSIZE;
+    } else {
+      level = 0;
+      sz = PGSIZE;
+    }
+    if((pte = walklevel(pagetable, a, 1, level, 0)) == 0)
       return -1;
+    if(level == 1 && (*pte & PTE_V) && !PTE_LEAF(*pte)){
+      // a page-table page left over from earlier 4096-byte
+      // mappings covers this megapage; map it page by page.
+      level = 0;
+      sz = PGSIZE;
+      if((pte = walklevel(pagetable, a, 1, level, 0)) == 0)
+        return -1;
+    }
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(last - a < sz)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += sz;
+    pa += sz;
   }
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. The mappings must exist. A megapage that is
+// only partly unmapped is first split into 4096-byte pages.
 // Optionally free the physical memory.
-void
+// Returns 0 on success, or -1, with nothing unmapped, if
+// there is no memory to split a megapage.
+int
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, sz, end;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
+  // only the megapages at either end can be partly unmapped.
+  end = va + npages*PGSIZE;
+  if(npages > 0 && va % SUPERPGSIZE != 0 && uvmsplit(pagetable, va) != 0)
+    return -1;
+  if(npages > 0 && end % SUPERPGSIZE != 0 && uvmsplit(pagetable, end - PGSIZE) != 0)
+    return -1;
+
+  for(a = va; a < end; a += sz){
+    if((pte = walklevel(pagetable, a, 0, 0, &level)) == 0)
       panic("uvmunmap: walk");
     if((*pte & PTE_V) == 0)
       panic("uvmunmap: not mapped");
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    sz = PXSIZE(level);
+    if(a % sz != 0 || a + sz > end)
+      panic("uvmunmap: partial megapage");
     if(do_free){
       uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      if(sz == SUPERPGSIZE)
+        superfree((void*)pa);
+      else
+        kfree((void*)pa);
     }
     *pte = 0;
   }
+  return 0;
+}
+
+// Split the megapage that maps va into 512 4096-byte pages
+// with the same permissions, so that part of it can be
+// unmapped or have its permissions changed. The physical
+// memory stays where it is; from now on its pages are freed
+// one at a time with kfree(). Does nothing if va is not in
+// a megapage. Returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  uint64 pa;
+  uint flags;
+  int level;
+
+  if((pte = walklevel(pagetable, va, 0, 0, &level)) == 0 || level == 0)
+    return 0;
+  if((*pte & PTE_V) == 0)
+    return 0;
+  if(level != 1)
+    panic("uvmsplit: level");
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
 }
 
 // create an empty user page table.
@@ -221,26 +314,36 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 }
 
 // Allocate PTEs and physical memory to grow process from oldsz to
-// newsz, which need not be page aligned.  Returns new size or 0 on error.
+// newsz, which need not be page aligned.  Each SUPERPGSIZE-aligned
+// megapage that lies wholly within the new memory is backed by a
+// superpage, if one is free.  Returns new size or 0 on error.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 {
   char *mem;
-  uint64 a;
+  uint64 a, sz;
 
   if(newsz < oldsz)
     return oldsz;
 
   oldsz = PGROUNDUP(oldsz);
-  for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+  for(a = oldsz; a < newsz; a += sz){
+    sz = SUPERPGSIZE;
+    if(a % SUPERPGSIZE != 0 || newsz - a < SUPERPGSIZE ||
+       (mem = superalloc()) == 0){
+      sz = PGSIZE;
+      mem = kalloc();
+    }
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
-      kfree(mem);
+    memset(mem, 0, sz);
+    if(mappages(pagetable, a, sz, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
+      if(sz == SUPERPGSIZE)
+        superfree(mem);
+      else
+        kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
@@ -251,7 +354,8 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if out of
+// memory to split a megapage.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -260,7 +364,8 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    if(uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1) < 0)
+      return oldsz;
   }
 
   return newsz;
@@ -306,22 +411,32 @@ int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
   pte_t *pte;
-  uint64 pa, i;
+  uint64 pa, i, n;
   uint flags;
   char *mem;
+  int level;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
+  for(i = 0; i < sz; i += n){
+    if((pte = walklevel(old, i, 0, 0, &level)) == 0)
       panic("uvmcopy: pte should exist");
     if((*pte & PTE_V) == 0)
       panic("uvmcopy: page not present");
-    pa = PTE2PA(*pte);
+    pa = PTE2PA(*pte) + (i & (PXSIZE(level) - 1));
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    // copy a megapage into a superpage if there is one free,
+    // otherwise into 4096-byte pages.
+    n = SUPERPGSIZE;
+    if(level == 0 || i % SUPERPGSIZE != 0 || (mem = superalloc()) == 0){
+      n = PGSIZE;
+      if((mem = kalloc()) == 0)
+        goto err;
+    }
+    memmove(mem, (char*)pa, n);
+    if(mappages(new, i, n, (uint64)mem, flags) != 0){
+      if(n == SUPERPGSIZE)
+        superfree(mem);
+      else
+        kfree(mem);
       goto err;
     }
   }
@@ -334,15 +449,51 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
-void
+// Returns 0, or -1 if out of memory to split a megapage.
+int
 uvmclear(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   
+  if(uvmsplit(pagetable, va) != 0)
+    return -1;
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
   *pte &= ~PTE_U;
+  return 0;
+}
+
+// Look up a user virtual address like walkaddr(), but
+// return the physical address of va itself, and set *n
+// to the number of bytes from va to the end of the page
+// or megapage that maps it. If write is set, the page must
+// be writable, and is marked dirty, as the hardware would,
+// since the kernel writes it through its own mapping.
+// Returns 0 if not mapped, or not writable and write is set.
+static uint64
+walkuser(pagetable_t pagetable, uint64 va, int write, uint64 *n)
+{
+  pte_t *pte;
+  int level;
+
+  if(va >= MAXVA)
+    return 0;
+
+  pte = walklevel(pagetable, va, 0, 0, &level);
+  if(pte == 0)
+    return 0;
+  if((*pte & PTE_V) == 0)
+    return 0;
+  if((*pte & PTE_U) == 0)
+    return 0;
+  if(write){
+    if((*pte & PTE_W) == 0)
+      return 0;
+    *pte |= PTE_D;
+  }
+  *n = PXSIZE(level) - (va & (PXSIZE(level) - 1));
+  return PTE2PA(*pte) + (va & (PXSIZE(level) - 1));
 }
 
 // Copy from kernel to user.
@@ -351,21 +502,21 @@ uvmclear(pagetable_t pagetable, uint64 va)
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa0;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = walkuser(pagetable, dstva, 1, &n);
+    if(pa0 == 0 && mmapfault(pagetable, dstva, 1) == 0)
+      pa0 = walkuser(pagetable, dstva, 1, &n);
     if(pa0 == 0)
       return -1;
-    n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    memmove((void *)pa0, src, n);
 
     len -= n;
     src += n;
-    dstva = va0 + PGSIZE;
+    dstva += n;
   }
   return 0;
 }
@@ -376,21 +527,21 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa0;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = walkuser(pagetable, srcva, 0, &n);
+    if(pa0 == 0 && mmapfault(pagetable, srcva, 0) == 0)
+      pa0 = walkuser(pagetable, srcva, 0, &n);
     if(pa0 == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    memmove(dst, (void *)pa0, n);
 
     len -= n;
     dst += n;
-    srcva = va0 + PGSIZE;
+    srcva += n;
   }
   return 0;
 }
@@ -402,19 +553,20 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa0;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = walkuser(pagetable, srcva, 0, &n);
+    if(pa0 == 0 && mmapfault(pagetable, srcva, 0) == 0)
+      pa0 = walkuser(pagetable, srcva, 0, &n);
     if(pa0 == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
+    srcva += n;
 
-    char *p = (char *) (pa0 + (srcva - va0));
+    char *p = (char *) pa0;
     while(n > 0){
       if(*p == '\0'){
         *dst = '\0';
@@ -428,8 +580,6 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
-
-    srcva = va0 + PGSIZE;
   }
   if(got_null){
     return 0;
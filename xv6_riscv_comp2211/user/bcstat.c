@@ -0,0 +1,87 @@
+// Report how the buffer cache did while a command ran, for
+// each region of the disk: lookups that hit and missed, cached
+// blocks pushed out, and blocks read and written with the
+// average time each took, in microseconds (the timer runs at
+// 10 MHz under qemu). With no command, report the totals
+// since boot.
+//
+// usage: bcstat [command [args...]]
+
+#include "kernel/types.h"
+#include "kernel/bcstat.h"
+#include "user/user.h"
+
+#define TICKSPERUS 10
+
+char *names[BC_NREGION] = {
+[BC_LOG]    "log",
+[BC_INODE]  "inode",
+[BC_BITMAP] "bitmap",
+[BC_DATA]   "data",
+};
+
+// Average of t over n, in microseconds.
+static int
+avgus(uint64 t, uint64 n)
+{
+  return n ? (int)(t / n / TICKSPERUS) : 0;
+}
+
+static void
+show(char *name, struct bcregion *r)
+{
+  uint64 n = r->hits + r->misses;
+
+  printf("%s %d %d %d %d %d %d %d %d\n", name,
+         (int)r->hits, (int)r->misses, n ? (int)(r->hits * 100 / n) : 0,
+         (int)r->evictions,
+         (int)r->reads, avgus(r->readtime, r->reads),
+         (int)r->writes, avgus(r->writetime, r->writes));
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct bcstat a, b;
+  struct bcregion *r, *r0, tot;
+  int i;
+
+  memset(&a, 0, sizeof(a));
+  if(argc > 1){
+    bcstat(&a);
+    if(spawn(argv[1], argv+1, 0, 0) < 0){
+      fprintf(2, "bcstat: cannot run %s\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+  if(bcstat(&b) < 0){
+    fprintf(2, "bcstat: bcstat failed\n");
+    exit(1);
+  }
+
+  printf("policy %s\n", b.policy);
+  printf("region hits misses hit%% evictions reads us/read writes us/write\n");
+  memset(&tot, 0, sizeof(tot));
+  for(i = 0; i < BC_NREGION; i++){
+    r = &b.r[i];
+    r0 = &a.r[i];
+    r->hits -= r0->hits;
+    r->misses -= r0->misses;
+    r->evictions -= r0->evictions;
+    r->reads -= r0->reads;
+    r->readtime -= r0->readtime;
+    r->writes -= r0->writes;
+    r->writetime -= r0->writetime;
+    show(names[i], r);
+    tot.hits += r->hits;
+    tot.misses += r->misses;
+    tot.evictions += r->evictions;
+    tot.reads += r->reads;
+    tot.readtime += r->readtime;
+    tot.writes += r->writes;
+    tot.writetime += r->writetime;
+  }
+  show("total", &tot);
+  exit(0);
+}
@@ -0,0 +1,82 @@
+// Time creating, opening and removing many files in one
+// directory, to show the cost of directory lookups.
+//
+// usage: dirbench [files]
+//
+// The default of 100 files fits in the stock file system,
+// which has 200 inodes, and is enough to need the directory's
+// index blocks.
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+void
+fname(char *buf, int i)
+{
+  int j;
+
+  buf[0] = 'f';
+  for(j = 5; j >= 1; j--){
+    buf[j] = '0' + i % 10;
+    i /= 10;
+  }
+  buf[6] = 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, fd, start;
+  char name[8];
+
+  n = 100;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n <= 0 || n > 99999){
+    fprintf(2, "usage: dirbench [files]\n");
+    exit(1);
+  }
+
+  if(mkdir("dirbench.d") < 0 || chdir("dirbench.d") < 0){
+    fprintf(2, "dirbench: cannot make dirbench.d\n");
+    exit(1);
+  }
+
+  start = uptime();
+  for(i = 0; i < n; i++){
+    fname(name, i);
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      fprintf(2, "dirbench: create failed after %d files\n", i);
+      n = i;
+      break;
+    }
+    close(fd);
+  }
+  printf("create: %d files in %d ticks\n", n, uptime() - start);
+
+  start = uptime();
+  for(i = 0; i < n; i++){
+    fname(name, i);
+    if((fd = open(name, O_RDONLY)) < 0){
+      fprintf(2, "dirbench: open %s failed\n", name);
+      exit(1);
+    }
+    close(fd);
+  }
+  printf("open:   %d files in %d ticks\n", n, uptime() - start);
+
+  start = uptime();
+  for(i = 0; i < n; i++){
+    fname(name, i);
+    if(unlink(name) < 0){
+      fprintf(2, "dirbench: unlink %s failed\n", name);
+      exit(1);
+    }
+  }
+  printf("unlink: %d files in %d ticks\n", n, uptime() - start);
+
+  chdir("..");
+  unlink("dirbench.d");
+  exit(0);
+}
@@ -0,0 +1,46 @@
+// Run stressfs, whose processes write their files at the
+// same time, then report how fragmented those files are:
+// how many runs of contiguous disk blocks each occupies.
+//
+// usage: fragbench
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NFILE 5
+
+int
+main(int argc, char *argv[])
+{
+  char *args[] = { "stressfs", 0 };
+  char path[] = "stressfs0";
+  struct stat st;
+  int i, fd, blocks, runs, r;
+
+  if(spawn(args[0], args, 0, 0) < 0){
+    fprintf(2, "fragbench: cannot run stressfs\n");
+    exit(1);
+  }
+  wait(0);
+
+  blocks = runs = 0;
+  for(i = 0; i < NFILE; i++){
+    path[8] = '0' + i;
+    if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0 ||
+       (r = fruns(fd)) < 0){
+      fprintf(2, "fragbench: cannot stat %s\n", path);
+      exit(1);
+    }
+    close(fd);
+    printf("%s: %d blocks in %d runs\n", path, st.blocks, r);
+    blocks += st.blocks;
+    runs += r;
+    unlink(path);
+  }
+  if(runs > 0)
+    printf("%d blocks in %d runs: %d.%d blocks per run\n", blocks, runs,
+           blocks / runs, blocks * 10 / runs % 10);
+  exit(0);
+}
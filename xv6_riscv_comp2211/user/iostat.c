@@ -0,0 +1,46 @@
+// Report what the block request queue did while a command
+// ran: how many buffers were read or written, how many of
+// them were merged into another request, and how many blocks
+// the disk requests carried on average, and how the kernel
+// learned they were done: by polling or by interrupt. With no
+// command, report the totals since boot.
+//
+// usage: iostat [command [args...]]
+
+#include "kernel/types.h"
+#include "kernel/blkstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct blkstat a, b;
+  uint64 avg10;
+
+  memset(&a, 0, sizeof(a));
+  if(argc > 1){
+    blkstat(&a);
+    if(spawn(argv[1], argv+1, 0, 0) < 0){
+      fprintf(2, "iostat: cannot run %s\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+  if(blkstat(&b) < 0){
+    fprintf(2, "iostat: blkstat failed\n");
+    exit(1);
+  }
+
+  b.bufs -= a.bufs;
+  b.merges -= a.merges;
+  b.requests -= a.requests;
+  b.blocks -= a.blocks;
+  b.polls -= a.polls;
+  b.intrs -= a.intrs;
+  avg10 = b.requests ? b.blocks * 10 / b.requests : 0;
+  printf("buffers %d merged %d requests %d blocks/request %d.%d\n",
+         (int)b.bufs, (int)b.merges, (int)b.requests,
+         (int)(avg10 / 10), (int)(avg10 % 10));
+  printf("interrupts %d polls %d\n", (int)b.intrs, (int)b.polls);
+  exit(0);
+}
@@ -136,26 +136,14 @@ char **split_string(const char *str)
     return result;
 }
 
-// creates forks and execs commands
+// spawns a command with in_fd and out_fd as its standard input and output
 int fork_and_exec(char **cmd, int in_fd, int out_fd) {
-    int pid = fork();
-    
-    if (pid == 0) { // Child process
-        if (in_fd != 0) { // Replace standard input with in_fd
-            close(0);
-            dup(in_fd);
-            close(in_fd);
-        }
-
-        if (out_fd != 1) { // Replace standard output with out_fd
-            close(1);
-            dup(out_fd);
-            close(out_fd);
-        }
+    // child gets only these, so no pipe ends leak into it
+    int fds[3] = {in_fd, out_fd, 2};
+    int pid = spawn(cmd[0], cmd, fds, 3);
 
-        exec(cmd[0], cmd);
+    if (pid < 0) {
         printf("exec %s failed\n", cmd[0]);
-        exit(1);
     }
     return pid;
 }
@@ -1,14 +1,126 @@
 #include "kernel/types.h"
 #include "user/user.h"
 
-#include "user.h"
+#define SHMKEY 0x5050
 
-int main(void)
+// Bounce a byte between parent and child n times over a pair
+// of pipes. Returns the number of ticks taken.
+int pipebench(int n)
+{
+  int p2c[2], c2p[2];
+  char buf = 'P';
+  int i, pid, start;
+
+  if (pipe(p2c) < 0 || pipe(c2p) < 0)
+  {
+    printf("Pipe creation failed\n");
+    exit(-1);
+  }
+
+  pid = fork();
+  if (pid < 0)
+  {
+    printf("Fork failed\n");
+    exit(-1);
+  }
+
+  if (pid == 0)
+  {
+    for (i = 0; i < n; i++)
+    {
+      read(p2c[0], &buf, 1);
+      write(c2p[1], &buf, 1);
+    }
+    exit(0);
+  }
+
+  start = uptime();
+  for (i = 0; i < n; i++)
+  {
+    write(p2c[1], &buf, 1);
+    read(c2p[0], &buf, 1);
+  }
+  start = uptime() - start;
+  wait(0);
+  close(p2c[0]);
+  close(p2c[1]);
+  close(c2p[0]);
+  close(c2p[1]);
+  return start;
+}
+
+// Bounce a counter between parent and child n times through
+// a shared memory segment. Each side spins until it is its
+// turn, so no data passes through the kernel at all.
+// Returns the number of ticks taken.
+int shmbench(int n)
+{
+  volatile int *turn;
+  int i, id, pid, start;
+
+  if ((id = shmget(SHMKEY, sizeof(int))) < 0 ||
+      (turn = shmat(id)) == (int *)-1)
+  {
+    printf("Shared memory setup failed\n");
+    exit(-1);
+  }
+  *turn = 0;
+
+  // The child inherits the attachment.
+  pid = fork();
+  if (pid < 0)
+  {
+    printf("Fork failed\n");
+    exit(-1);
+  }
+
+  if (pid == 0)
+  {
+    for (i = 0; i < n; i++)
+    {
+      while (*turn != 2 * i + 1)
+        ;
+      __sync_synchronize();
+      *turn = 2 * i + 2;
+    }
+    exit(0);
+  }
+
+  start = uptime();
+  for (i = 0; i < n; i++)
+  {
+    *turn = 2 * i + 1;
+    __sync_synchronize();
+    while (*turn != 2 * i + 2)
+      ;
+  }
+  start = uptime() - start;
+  wait(0);
+  shmdt((void *)turn);
+  return start;
+}
+
+int main(int argc, char *argv[])
 {
   int p2c[2], c2p[2];
   char ping = 'P', pong = 'R';
   char buf;
-  int pid;
+  int pid, n;
+
+  // With a count, compare round-trip latency over pipes
+  // and over shared memory.
+  if (argc > 1)
+  {
+    n = atoi(argv[1]);
+    if (n <= 0)
+    {
+      printf("usage: pingpong [rounds]\n");
+      exit(-1);
+    }
+    printf("pipe: %d round trips in %d ticks\n", n, pipebench(n));
+    printf("shm:  %d round trips in %d ticks\n", n, shmbench(n));
+    exit(0);
+  }
 
   // Creating Pipes
   if (pipe(p2c) < 0 || pipe(c2p) < 0)
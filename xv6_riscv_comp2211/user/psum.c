@@ -0,0 +1,92 @@
+// Sum a large array with 1, 2, ... threads made by clone(),
+// and print how long each run takes. With enough CPUS
+// the time should drop as threads are added.
+//
+// usage: psum [maxthreads]
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define N       (1 << 20)  // ints to sum
+#define ROUNDS  16         // passes over the array
+#define STACKSZ 4096
+
+int *a;
+int nt;
+uint64 partial[NTHREAD];
+
+// Sum thread t's share of a[].
+void
+sumpart(int t)
+{
+  int i, r, lo, hi;
+  uint64 s = 0;
+
+  lo = (uint64)N * t / nt;
+  hi = (uint64)N * (t + 1) / nt;
+  for(r = 0; r < ROUNDS; r++)
+    for(i = lo; i < hi; i++)
+      s += a[i];
+  partial[t] = s;
+}
+
+void
+worker(void *arg)
+{
+  sumpart((int)(uint64)arg);
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, t, maxt, start, ticks;
+  uint64 sum, expect;
+  char *stacks[NTHREAD];
+
+  maxt = 4;
+  if(argc > 1)
+    maxt = atoi(argv[1]);
+  if(maxt < 1 || maxt > NTHREAD){
+    fprintf(2, "psum: 1 to %d threads\n", NTHREAD);
+    exit(1);
+  }
+
+  if((a = (int*)sbrk(N * sizeof(int))) == (int*)-1){
+    fprintf(2, "psum: sbrk failed\n");
+    exit(1);
+  }
+  expect = 0;
+  for(i = 0; i < N; i++){
+    a[i] = i & 0xff;
+    expect += a[i];
+  }
+  expect *= ROUNDS;
+  for(t = 0; t < NTHREAD; t++)
+    stacks[t] = malloc(STACKSZ);
+
+  for(nt = 1; nt <= maxt; nt++){
+    start = uptime();
+    for(t = 1; t < nt; t++){
+      if(clone(worker, (void*)(uint64)t, stacks[t], STACKSZ) < 0){
+        fprintf(2, "psum: clone failed\n");
+        exit(1);
+      }
+    }
+    sumpart(0);
+    for(t = 1; t < nt; t++)
+      join(0);
+    ticks = uptime() - start;
+
+    sum = 0;
+    for(t = 0; t < nt; t++)
+      sum += partial[t];
+    if(sum != expect){
+      fprintf(2, "psum: wrong sum with %d threads\n", nt);
+      exit(1);
+    }
+    printf("%d threads: %d ticks\n", nt, ticks);
+  }
+  exit(0);
+}
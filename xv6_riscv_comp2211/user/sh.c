@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/param.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -53,6 +54,7 @@ int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
 void runcmd(struct cmd*) __attribute__((noreturn));
+int spawncmd(struct cmd*, int*);
 
 // Execute cmd.  Never returns.
 void
@@ -62,7 +64,6 @@ runcmd(struct cmd *cmd)
   struct backcmd *bcmd;
   struct execcmd *ecmd;
   struct listcmd *lcmd;
-  struct pipecmd *pcmd;
   struct redircmd *rcmd;
 
   if(cmd == 0)
@@ -99,27 +100,10 @@ runcmd(struct cmd *cmd)
     break;
 
   case PIPE:
-    pcmd = (struct pipecmd*)cmd;
-    if(pipe(p) < 0)
-      panic("pipe");
-    if(fork1() == 0){
-      close(1);
-      dup(p[1]);
-      close(p[0]);
-      close(p[1]);
-      runcmd(pcmd->left);
-    }
-    if(fork1() == 0){
-      close(0);
-      dup(p[0]);
-      close(p[0]);
-      close(p[1]);
-      runcmd(pcmd->right);
-    }
-    close(p[0]);
-    close(p[1]);
-    wait(0);
-    wait(0);
+    p[0] = 0;
+    p[1] = 1;
+    for(int n = spawncmd(cmd, p); n > 0; n--)
+      wait(0);
     break;
 
   case BACK:
@@ -131,6 +115,80 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Start cmd with standard input fds[0] and standard output
+// fds[1], using spawn() for each program rather than a fork()
+// of the shell. Returns the number of children started,
+// which the caller must wait() for.
+int
+spawncmd(struct cmd *cmd, int *fds)
+{
+  int p[2], fd, save, n, pid;
+  int cfds[3];
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    if(ecmd->argv[0] == 0)
+      return 0;
+    cfds[0] = fds[0];
+    cfds[1] = fds[1];
+    cfds[2] = 2;
+    if(spawn(ecmd->argv[0], ecmd->argv, cfds, 3) < 0){
+      fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    if((fd = open(rcmd->file, rcmd->mode)) < 0){
+      fprintf(2, "open %s failed\n", rcmd->file);
+      return 0;
+    }
+    save = fds[rcmd->fd];
+    fds[rcmd->fd] = fd;
+    n = spawncmd(rcmd->cmd, fds);
+    fds[rcmd->fd] = save;
+    close(fd);
+    return n;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    if(pipe(p) < 0)
+      panic("pipe");
+    save = fds[1];
+    fds[1] = p[1];
+    n = spawncmd(pcmd->left, fds);
+    fds[1] = save;
+    close(p[1]);
+    save = fds[0];
+    fds[0] = p[0];
+    n += spawncmd(pcmd->right, fds);
+    fds[0] = save;
+    close(p[0]);
+    return n;
+
+  default:
+    // lists and background jobs need a shell of their own.
+    pid = fork1();
+    if(pid == 0){
+      for(fd = 0; fd < 2; fd++){
+        if(fds[fd] != fd){
+          close(fd);
+          dup(fds[fd]);
+        }
+      }
+      for(fd = 3; fd < NOFILE; fd++)
+        close(fd);
+      runcmd(cmd);
+    }
+    return 1;
+  }
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -0,0 +1,104 @@
+// Time launching the pipeline "echo hello | cat | cat | cat"
+// with fork()+exec() and with spawn().
+//
+// usage: spawnbench [rounds]
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define NSTAGE 4
+
+char *stages[NSTAGE][3] = {
+  { "echo", "hello", 0 },
+  { "cat", 0 },
+  { "cat", 0 },
+  { "cat", 0 },
+};
+
+// Start stage i reading in and writing out, the way the
+// shell used to: fork a copy of ourselves, then exec.
+int
+forkstage(int i, int in, int out)
+{
+  int fd, pid;
+
+  pid = fork();
+  if(pid == 0){
+    close(0);
+    dup(in);
+    close(1);
+    dup(out);
+    for(fd = 3; fd < NOFILE; fd++)
+      close(fd);
+    exec(stages[i][0], stages[i]);
+    exit(1);
+  }
+  return pid;
+}
+
+int
+spawnstage(int i, int in, int out)
+{
+  int fds[3] = { in, out, 2 };
+
+  return spawn(stages[i][0], stages[i], fds, 3);
+}
+
+// Run the pipeline once, using start() for each stage,
+// and wait for it to finish.
+void
+pipeline(int (*start)(int, int, int))
+{
+  int i, in, p[2];
+  char buf[64];
+
+  in = 0;
+  for(i = 0; i < NSTAGE; i++){
+    if(pipe(p) < 0){
+      fprintf(2, "spawnbench: pipe failed\n");
+      exit(1);
+    }
+    if(start(i, in, p[1]) < 0){
+      fprintf(2, "spawnbench: cannot start %s\n", stages[i][0]);
+      exit(1);
+    }
+    close(p[1]);
+    if(in != 0)
+      close(in);
+    in = p[0];
+  }
+  while(read(in, buf, sizeof(buf)) > 0)
+    ;
+  close(in);
+  for(i = 0; i < NSTAGE; i++)
+    wait(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, start;
+
+  n = 50;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n <= 0){
+    fprintf(2, "usage: spawnbench [rounds]\n");
+    exit(1);
+  }
+
+  // make fork() copy something closer to a shell's worth of memory.
+  sbrk(64*1024);
+
+  start = uptime();
+  for(i = 0; i < n; i++)
+    pipeline(forkstage);
+  printf("fork+exec: %d pipelines in %d ticks\n", n, uptime() - start);
+
+  start = uptime();
+  for(i = 0; i < n; i++)
+    pipeline(spawnstage);
+  printf("spawn:     %d pipelines in %d ticks\n", n, uptime() - start);
+  exit(0);
+}
@@ -1,6 +1,7 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/param.h"
 #include "user/user.h"
 
 //
@@ -145,3 +146,64 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// Mutexes and condition variables in the style of Drepper's
+// "Futexes Are Tricky". An uncontended lock or unlock is a
+// single atomic instruction; only a thread that has to wait,
+// or that releases a lock someone may be waiting for, enters
+// the kernel.
+
+void
+mutex_lock(struct mutex *m)
+{
+  int c, i;
+
+  if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+  // spin a little first in case the holder is about to let go.
+  for(i = 0; i < 100; i++){
+    if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+      return;
+  }
+  if(c != 2)
+    c = __sync_lock_test_and_set(&m->state, 2);
+  while(c != 0){
+    futexwait(&m->state, 2);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->state, 1) != 1){
+    __sync_lock_release(&m->state);
+    futexwake(&m->state, 1);
+  }
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq = c->seq;
+
+  mutex_unlock(m);
+  futexwait(&c->seq, seq);
+  // we may not be the only waiter, so mark the mutex contended.
+  while(__sync_lock_test_and_set(&m->state, 2) != 0)
+    futexwait(&m->state, 2);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futexwake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futexwake(&c->seq, NPROC);
+}
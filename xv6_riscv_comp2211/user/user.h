@@ -1,4 +1,16 @@
 struct stat;
+struct blkstat;
+struct bcstat;
+
+// A sleeping mutex and a condition variable, for processes
+// sharing memory. Zero-initialized means unlocked/no waiters.
+struct mutex {
+  int state;  // 0 unlocked, 1 locked, 2 locked and maybe waiters
+};
+
+struct cond {
+  int seq;    // bumped by every signal
+};
 
 // system calls
 int fork(void);
@@ -22,6 +34,19 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void *mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int shmget(int, uint);
+void *shmat(int);
+int shmdt(void*);
+int futexwait(int*, int);
+int futexwake(int*, int);
+int clone(void (*)(void*), void*, void*, int);
+int join(void**);
+int spawn(const char*, char**, int*, int);
+int fruns(int);
+int blkstat(struct blkstat*);
+int bcstat(struct bcstat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -39,3 +64,8 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/bcstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -578,6 +579,8 @@ writetest(char *s)
 void
 writebig(char *s)
 {
+  // past the end of what a single indirect block can map.
+  enum { N = NDIRECT + NINDIRECT + 64 };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -586,7 +589,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < N; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +609,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != N){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -1953,6 +1956,74 @@ iref(char *s)
   chdir("/");
 }
 
+// hold more distinct inodes open at once than the inode
+// table starts with, so that it has to grow.
+void
+manyinodes(char *s)
+{
+  enum { NCHILD = 6, NF = 10 };
+  int ready[2], go[2], c, i, pid, xstatus, bad;
+  char name[8], x;
+
+  if(NCHILD * NF <= NINODE){
+    printf("%s: too few files\n", s);
+    exit(1);
+  }
+  if(pipe(ready) < 0 || pipe(go) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(c = 0; c < NCHILD; c++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(ready[0]);
+      close(go[1]);
+      name[0] = 'm';
+      name[1] = 'i';
+      name[2] = '0' + c;
+      name[4] = 0;
+      x = 'r';
+      for(i = 0; i < NF; i++){
+        name[3] = '0' + i;
+        if(open(name, O_CREATE|O_RDWR) < 0){
+          x = 'x';
+          break;
+        }
+      }
+      // keep them open until every child has opened its own.
+      write(ready[1], &x, 1);
+      read(go[0], &x, 1);
+      for(i = 0; i < NF; i++){
+        name[3] = '0' + i;
+        unlink(name);
+      }
+      exit(x == 'x');
+    }
+  }
+  close(ready[1]);
+  close(go[0]);
+  bad = 0;
+  for(c = 0; c < NCHILD; c++){
+    if(read(ready[0], &x, 1) != 1 || x != 'r')
+      bad = 1;
+  }
+  close(go[1]);
+  close(ready[0]);
+  for(c = 0; c < NCHILD; c++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      bad = 1;
+  }
+  if(bad){
+    printf("%s: could not hold %d inodes open\n", s, NCHILD * NF);
+    exit(1);
+  }
+}
+
 // test that fork fails gracefully
 // the forktest binary also does this, but it runs out of proc entries first.
 // inside the bigger usertests binary, we run out of memory first.
@@ -2556,6 +2627,79 @@ sbrk8000(char *s)
 
 
 
+// grow the heap enough to be mapped with 2 MiB megapages,
+// check that fork() copies it, then shrink it to the middle
+// of a megapage.
+void
+sbrkmega(char *s)
+{
+  char *old, *base, *top, *mid, *a;
+  int pid, xstatus;
+
+  old = sbrk(0);
+  base = (char*)PGROUNDUP((uint64)old);
+  // at least one whole, aligned megapage below top.
+  top = (char*)(SUPERPGROUNDUP((uint64)old) + 2*SUPERPGSIZE);
+  if(sbrk(top - old) != old){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(a = base; a < top; a += PGSIZE)
+    *(uint64*)a = (uint64)a;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(a = base; a < top; a += PGSIZE)
+      if(*(uint64*)a != (uint64)a)
+        exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong heap contents\n", s);
+    exit(1);
+  }
+
+  // a few pages into the last megapage.
+  mid = top - SUPERPGSIZE + 5*PGSIZE;
+  if(sbrk(mid - top) != top || sbrk(0) != mid){
+    printf("%s: shrink failed\n", s);
+    exit(1);
+  }
+  for(a = base; a < mid; a += PGSIZE){
+    if(*(uint64*)a != (uint64)a){
+      printf("%s: shrink lost %p\n", s, a);
+      exit(1);
+    }
+  }
+  for(a = mid; a < top; a += SUPERPGSIZE/2 - PGSIZE){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      *(volatile char*)a = 1;
+      printf("%s: oops wrote freed %p\n", s, a);
+      exit(1);
+    }
+    wait(&xstatus);
+    if(xstatus != -1)  // did kernel kill child?
+      exit(1);
+  }
+
+  // a page given back and grown again must be zero.
+  if(sbrk(PGSIZE) != mid || *(uint64*)mid != 0){
+    printf("%s: regrown page not zero\n", s);
+    exit(1);
+  }
+  sbrk(old - sbrk(0));
+}
+
 // regression test. test whether exec() leaks memory if one of the
 // arguments is invalid. the test passes if the kernel doesn't panic.
 void
@@ -2571,6 +2715,797 @@ badarg(char *s)
   exit(0);
 }
 
+// mmap() a file MAP_SHARED and MAP_PRIVATE, and share an
+// anonymous region with a child.
+void
+mmaptest(char *s)
+{
+  char *file = "mmap.dat";
+  int fd, i, pid, xstatus;
+  char *p, *q;
+
+  unlink(file);
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf, 2*PGSIZE + 100) != 2*PGSIZE + 100){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1 || q == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*PGSIZE + 100; i++){
+    if(p[i] != 'a' + i % 26 || q[i] != 'a' + i % 26){
+      printf("%s: wrong content at %d\n", s, i);
+      exit(1);
+    }
+  }
+  // past end of file
+  if(p[2*PGSIZE + 100] != 0 || q[3*PGSIZE - 1] != 0){
+    printf("%s: not zero past EOF\n", s);
+    exit(1);
+  }
+  p[PGSIZE] = 'X';
+  q[0] = 'Y';
+  if(munmap(p, 3*PGSIZE) < 0 || munmap(q, 3*PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  // the shared write reached the file; the private one didn't.
+  close(fd);
+  fd = open(file, O_RDONLY);
+  if(read(fd, buf, PGSIZE + 1) != PGSIZE + 1){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  if(buf[0] != 'a'){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  if(buf[PGSIZE] != 'X'){
+    printf("%s: shared write not written back\n", s);
+    exit(1);
+  }
+  // can't map a read-only file for shared writing.
+  if(mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: mmap of read-only fd succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(file);
+
+  // anonymous shared memory is shared with a child.
+  p = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(p == (char*)-1){
+    printf("%s: anonymous mmap failed\n", s);
+    exit(1);
+  }
+  p[0] = 1;
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[0] = 2;
+    p[PGSIZE] = 3;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[0] != 2 || p[PGSIZE] != 3){
+    printf("%s: child's writes not seen\n", s);
+    exit(1);
+  }
+  if(munmap(p + PGSIZE, PGSIZE) < 0 || p[0] != 2){
+    printf("%s: partial munmap failed\n", s);
+    exit(1);
+  }
+  munmap(p, PGSIZE);
+}
+
+// read() into, and write() from, a mapping of the same file
+// that hasn't been touched yet: faulting the pages in must not
+// wait for the inode lock read() and write() hold.
+void
+mmapselfio(char *s)
+{
+  char *file = "mmself.dat";
+  int fd, fd2, i;
+  char *p;
+
+  unlink(file);
+  fd = open(file, O_CREATE|O_RDWR);
+  for(i = 0; i < 2*PGSIZE; i++)
+    buf[i] = 'a' + i % 26;
+  if(fd < 0 || write(fd, buf, 2*PGSIZE) != 2*PGSIZE){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  // the file's second page over the mapping's first.
+  fd2 = open(file, O_RDONLY);
+  if(fd2 < 0 || read(fd2, buf, PGSIZE) != PGSIZE || read(fd2, p, PGSIZE) != PGSIZE){
+    printf("%s: read into mapping failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+  if(p[0] != 'a' + PGSIZE % 26){
+    printf("%s: wrong content\n", s);
+    exit(1);
+  }
+  // the mapping's untouched second page onto the file's end.
+  if(write(fd, p + PGSIZE, 10) != 10){
+    printf("%s: write from mapping failed\n", s);
+    exit(1);
+  }
+  munmap(p, 2*PGSIZE);
+  close(fd);
+  unlink(file);
+}
+
+// a read-only mapping can't be written through read(), and
+// no write to it reaches a file opened read-only.
+void
+mmaprdonly(char *s)
+{
+  char *file = "mmro.dat", *file2 = "mmro2.dat";
+  int fd, fd2;
+  char *p;
+
+  unlink(file);
+  unlink(file2);
+  memset(buf, 'a', PGSIZE);
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, PGSIZE) != PGSIZE){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  memset(buf, 'Z', PGSIZE);
+  fd2 = open(file2, O_CREATE|O_RDWR);
+  if(fd2 < 0 || write(fd2, buf, PGSIZE) != PGSIZE){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+
+  fd = open(file, O_RDONLY);
+  p = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  // once before the page is faulted in, once after.
+  for(int i = 0; i < 2; i++){
+    close(fd2);
+    fd2 = open(file2, O_RDONLY);
+    if(read(fd2, p, 10) >= 0){
+      printf("%s: read into a read-only mapping succeeded\n", s);
+      exit(1);
+    }
+    if(p[0] != 'a'){
+      printf("%s: read-only mapping changed\n", s);
+      exit(1);
+    }
+  }
+  if(munmap(p, PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  close(fd2);
+
+  fd = open(file, O_RDONLY);
+  if(read(fd, buf, PGSIZE) != PGSIZE || buf[0] != 'a'){
+    printf("%s: read-only file changed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(file);
+  unlink(file2);
+}
+
+// shared memory segments are shared by attachments in the
+// same process and across fork(), and go away at last detach.
+void
+shmtest(char *s)
+{
+  int id, pid, xstatus;
+  char *p, *q;
+
+  id = shmget(0x7357, 2*PGSIZE);
+  if(id < 0){
+    printf("%s: shmget failed\n", s);
+    exit(1);
+  }
+  if(shmget(0x7357, 3*PGSIZE) >= 0){
+    printf("%s: shmget grew a segment\n", s);
+    exit(1);
+  }
+  p = shmat(id);
+  q = shmat(id);
+  if(p == (char*)-1 || q == (char*)-1 || p == q){
+    printf("%s: shmat failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 0 || p[2*PGSIZE-1] != 0){
+    printf("%s: segment not zeroed\n", s);
+    exit(1);
+  }
+  p[PGSIZE] = 'a';
+  if(q[PGSIZE] != 'a'){
+    printf("%s: attachments not shared\n", s);
+    exit(1);
+  }
+  if(munmap(p, PGSIZE) == 0){
+    printf("%s: partial munmap of a segment succeeded\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[PGSIZE] != 'a')
+      exit(1);
+    q[0] = 'b';
+    shmdt(p);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[0] != 'b'){
+    printf("%s: child's writes not seen\n", s);
+    exit(1);
+  }
+  if(shmdt(p) < 0 || shmdt(q) < 0 || shmdt(q) == 0){
+    printf("%s: shmdt failed\n", s);
+    exit(1);
+  }
+
+  // the last detach freed the segment, so the key can be
+  // used again with a different size.
+  id = shmget(0x7357, 3*PGSIZE);
+  if(id < 0 || (p = shmat(id)) == (char*)-1 || p[0] != 0){
+    printf("%s: segment not freed\n", s);
+    exit(1);
+  }
+  shmdt(p);
+}
+
+// processes sharing a segment serialize on a futex-based
+// mutex, and a condition variable wakes a waiting parent.
+void
+futextest(char *s)
+{
+  enum { NCHILD = 4, N = 500 };
+  struct shared {
+    struct mutex m;
+    struct cond c;
+    int count;
+    int done;
+  } *sh;
+  int i, j, id, pid, xstatus;
+
+  id = shmget(0xf07e, sizeof(*sh));
+  if(id < 0 || (sh = shmat(id)) == (struct shared*)-1){
+    printf("%s: shm failed\n", s);
+    exit(1);
+  }
+  if(futexwait(&sh->count, 1) != -1){
+    printf("%s: futexwait didn't check the value\n", s);
+    exit(1);
+  }
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < N; j++){
+        mutex_lock(&sh->m);
+        sh->count++;
+        mutex_unlock(&sh->m);
+      }
+      mutex_lock(&sh->m);
+      sh->done++;
+      cond_signal(&sh->c);
+      mutex_unlock(&sh->m);
+      exit(0);
+    }
+  }
+
+  mutex_lock(&sh->m);
+  while(sh->done < NCHILD)
+    cond_wait(&sh->c, &sh->m);
+  mutex_unlock(&sh->m);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  if(sh->count != NCHILD*N){
+    printf("%s: count %d, expected %d\n", s, sh->count, NCHILD*N);
+    exit(1);
+  }
+  shmdt(sh);
+}
+
+// threads made by clone() share memory and file descriptors,
+// and exit of the first thread takes the others with it.
+struct {
+  struct mutex m;
+  int count;
+  int fd;
+} tshared;
+
+void
+threadworker(void *arg)
+{
+  int i;
+
+  for(i = 0; i < 1000; i++){
+    mutex_lock(&tshared.m);
+    tshared.count++;
+    mutex_unlock(&tshared.m);
+  }
+  if(arg)
+    tshared.fd = open("thread.dat", O_CREATE|O_RDWR);
+  exit(0);
+}
+
+void
+threadspin(void *arg)
+{
+  for(;;)
+    ;
+}
+
+void
+threadtest(char *s)
+{
+  enum { NT = 4 };
+  char *stacks[NT];
+  void *stack;
+  int i, pid, xstatus;
+
+  tshared.count = 0;
+  tshared.fd = -1;
+  for(i = 0; i < NT; i++){
+    stacks[i] = malloc(PGSIZE);
+    if(clone(threadworker, (void*)(uint64)(i == 0), stacks[i], PGSIZE) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NT; i++){
+    if(join(&stack) < 0){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+    if(stack != stacks[0] && stack != stacks[1] &&
+       stack != stacks[2] && stack != stacks[3]){
+      printf("%s: join returned the wrong stack\n", s);
+      exit(1);
+    }
+  }
+  if(join(&stack) != -1 || wait(0) != -1){
+    printf("%s: extra thread\n", s);
+    exit(1);
+  }
+  if(tshared.count != NT*1000){
+    printf("%s: count %d, expected %d\n", s, tshared.count, NT*1000);
+    exit(1);
+  }
+  // the descriptor opened by a thread is ours too.
+  if(tshared.fd < 0 || write(tshared.fd, "x", 1) != 1 || close(tshared.fd) < 0){
+    printf("%s: fd not shared\n", s);
+    exit(1);
+  }
+  unlink("thread.dat");
+  for(i = 0; i < NT; i++)
+    free(stacks[i]);
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    stack = malloc(PGSIZE);
+    if(clone(threadspin, 0, stack, PGSIZE) < 0)
+      exit(1);
+    if(exec("echo", (char*[]){"echo", 0}) >= 0)
+      exit(1);
+    exit(7);
+  }
+  wait(&xstatus);
+  if(xstatus != 7){
+    printf("%s: exit with threads failed\n", s);
+    exit(1);
+  }
+}
+
+// spawn() starts a program with only the descriptors asked for.
+void
+spawntest(char *s)
+{
+  char *echoargv[] = { "echo", "spawned", 0 };
+  int fds[3], p[2], i, n, xstatus;
+  char b[16];
+
+  if(pipe(p) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  fds[0] = -1;
+  fds[1] = p[1];
+  fds[2] = 2;
+  if(spawn("echo", echoargv, fds, 3) < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(p[1]);
+  // the child has no copy of p[1], so we see EOF after its output.
+  n = 0;
+  while(n < sizeof(b) && (i = read(p[0], b + n, sizeof(b) - n)) > 0)
+    n += i;
+  if(n != 8 || memcmp(b, "spawned\n", 8) != 0){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+  close(p[0]);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+
+  if(spawn("nosuchprogram", echoargv, 0, 0) != -1 ||
+     spawn("echo", echoargv, (int[]){ 99 }, 1) != -1 || wait(0) != -1){
+    printf("%s: bad spawn succeeded\n", s);
+    exit(1);
+  }
+}
+
+// name lookups stay right as names are created and removed,
+// including after a failed lookup, and in a directory that is
+// removed and made again.
+void
+dcachetest(char *s)
+{
+  int fd, i;
+
+  for(i = 0; i < 2; i++){
+    if(mkdir("dcd") < 0){
+      printf("%s: mkdir failed\n", s);
+      exit(1);
+    }
+    if(open("dcd/f", O_RDONLY) >= 0){
+      printf("%s: opened a file that doesn't exist\n", s);
+      exit(1);
+    }
+    if((fd = open("dcd/f", O_CREATE|O_RDWR)) < 0){
+      printf("%s: create after failed lookup failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(link("dcd/f", "dcd/g") < 0 || (fd = open("dcd/g", O_RDONLY)) < 0){
+      printf("%s: link failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dcd/f") < 0 || open("dcd/f", O_RDONLY) >= 0){
+      printf("%s: open after unlink succeeded\n", s);
+      exit(1);
+    }
+    if(unlink("dcd/g") < 0 || unlink("dcd") < 0){
+      printf("%s: unlink failed\n", s);
+      exit(1);
+    }
+    if(open("dcd/g", O_RDONLY) >= 0 || chdir("dcd") == 0){
+      printf("%s: removed directory still found\n", s);
+      exit(1);
+    }
+  }
+}
+
+// a directory big enough to get a hash index: every name
+// must still be found, and a linear read (as ls does) must
+// still see every entry exactly once.
+void
+hashdir(char *s)
+{
+  enum { N = 200 };
+  int i, fd, n;
+  char name[4];
+  struct dirent de;
+
+  if(mkdir("hd") < 0 || chdir("hd") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  name[0] = 'h';
+  name[3] = 0;
+  for(i = 0; i < N; i++){
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+  // free slots in the middle of chains, then reuse them.
+  for(i = 0; i < N; i += 3){
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i += 3){
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf("%s: re-create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+  for(i = 0; i < N; i++){
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  if((fd = open(".", O_RDONLY)) < 0){
+    printf("%s: open . failed\n", s);
+    exit(1);
+  }
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum != 0 && de.name[0] == 'h')
+      n++;
+  }
+  close(fd);
+  if(n != N){
+    printf("%s: read %d entries, expected %d\n", s, n, N);
+    exit(1);
+  }
+
+  for(i = 0; i < N; i++){
+    name[1] = '0' + i / 64;
+    name[2] = '0' + i % 64;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  chdir("..");
+  if(unlink("hd") < 0){
+    printf("%s: unlink hd failed\n", s);
+    exit(1);
+  }
+}
+
+// two files written a block at a time in turn, so that
+// neither can keep growing its last extent.
+void
+extentinterleave(char *s)
+{
+  enum { N = 150 };
+  int fd[2], i, j, n;
+
+  for(j = 0; j < 2; j++){
+    if((fd[j] = open(j ? "ei1" : "ei0", O_CREATE|O_RDWR)) < 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    for(j = 0; j < 2; j++){
+      ((int*)buf)[0] = i;
+      ((int*)buf)[1] = j;
+      if(write(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: write %d of file %d failed\n", s, i, j);
+        exit(1);
+      }
+    }
+  }
+  for(j = 0; j < 2; j++){
+    close(fd[j]);
+    if((fd[j] = open(j ? "ei1" : "ei0", O_RDONLY)) < 0){
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    for(i = 0; (n = read(fd[j], buf, BSIZE)) == BSIZE; i++){
+      if(((int*)buf)[0] != i || ((int*)buf)[1] != j){
+        printf("%s: file %d block %d has wrong contents\n", s, j, i);
+        exit(1);
+      }
+    }
+    if(n != 0 || i != N){
+      printf("%s: file %d: read %d blocks\n", s, j, i);
+      exit(1);
+    }
+    close(fd[j]);
+  }
+  unlink("ei0");
+  unlink("ei1");
+}
+
+// small appends, read back through another descriptor while
+// the file is still open (and its new blocks only in memory),
+// and again once the last close has written them out.
+void
+delayalloc(char *s)
+{
+  enum { N = 20, SZ = 300 };
+  int fd, fd2, i, j;
+  char c;
+  struct stat st;
+
+  unlink("da");
+  if((fd = open("da", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, 'a' + i, SZ);
+    if(write(fd, buf, SZ) != SZ){
+      printf("%s: write %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  for(j = 0; j < 2; j++){
+    if((fd2 = open("da", O_RDONLY)) < 0){
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if(read(fd2, buf, SZ) != SZ){
+        printf("%s: short read\n", s);
+        exit(1);
+      }
+      c = 'a' + i;
+      if(buf[0] != c || buf[SZ-1] != c){
+        printf("%s: wrong data in record %d\n", s, i);
+        exit(1);
+      }
+    }
+    if(read(fd2, buf, 1) != 0){
+      printf("%s: read past end\n", s);
+      exit(1);
+    }
+    close(fd2);
+    if(j == 0)
+      close(fd);
+  }
+  if(stat("da", &st) < 0 || st.size != N*SZ || st.blocks != (N*SZ + BSIZE - 1) / BSIZE){
+    printf("%s: wrong size or blocks after close\n", s);
+    exit(1);
+  }
+  unlink("da");
+}
+
+// a tiny file lives in its inode, then moves to a block
+// when it grows, and goes back in when truncated.
+void
+inlinedata(char *s)
+{
+  int fd, i;
+  struct stat st;
+
+  unlink("il");
+  if((fd = open("il", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 300; i++){
+    buf[0] = i;
+    if(write(fd, buf, 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    if(i == 49){
+      if(fstat(fd, &st) < 0 || st.size != 50 || st.blocks != 0){
+        printf("%s: small file uses a block\n", s);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+
+  if((fd = open("il", O_RDONLY)) < 0 || read(fd, buf, 400) != 300){
+    printf("%s: read back failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 300; i++){
+    if((uchar)buf[i] != (uchar)i){
+      printf("%s: byte %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  if((fd = open("il", O_RDWR|O_TRUNC)) < 0 || write(fd, "tiny", 4) != 4){
+    printf("%s: rewrite failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(stat("il", &st) < 0 || st.size != 4 || st.blocks != 0){
+    printf("%s: truncated file not inline\n", s);
+    exit(1);
+  }
+  unlink("il");
+}
+
+// reading a file again finds its blocks in the buffer cache,
+// and bcstat() counts the hits in the data region.
+void
+bcstattest(char *s)
+{
+  struct bcstat a, b;
+  int fd;
+
+  unlink("bcs");
+  if((fd = open("bcs", O_CREATE|O_RDWR)) < 0 || write(fd, buf, 2*BSIZE) != 2*BSIZE){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("bcs", O_RDONLY)) < 0 || read(fd, buf, 2*BSIZE) != 2*BSIZE){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(bcstat(&a) < 0){
+    printf("%s: bcstat failed\n", s);
+    exit(1);
+  }
+  fd = open("bcs", O_RDONLY);
+  if(read(fd, buf, 2*BSIZE) != 2*BSIZE){
+    printf("%s: read again failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  bcstat(&b);
+  if(b.r[BC_DATA].hits < a.r[BC_DATA].hits + 2){
+    printf("%s: %d data hits, expected 2\n", s,
+           (int)(b.r[BC_DATA].hits - a.r[BC_DATA].hits));
+    exit(1);
+  }
+  if(b.r[BC_DATA].misses != a.r[BC_DATA].misses){
+    printf("%s: cached blocks missed\n", s);
+    exit(1);
+  }
+  unlink("bcs");
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2617,6 +3552,7 @@ struct test {
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
   {iref, "iref"},
+  {manyinodes, "manyinodes"},
   {forktest, "forktest"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
@@ -2634,7 +3570,21 @@ struct test {
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {sbrkmega, "sbrkmega"},
   {badarg, "badarg" },
+  {mmaptest, "mmaptest" },
+  {mmaprdonly, "mmaprdonly" },
+  {mmapselfio, "mmapselfio" },
+  {shmtest, "shmtest" },
+  {futextest, "futextest" },
+  {threadtest, "threadtest" },
+  {spawntest, "spawntest" },
+  {dcachetest, "dcachetest" },
+  {hashdir, "hashdir" },
+  {extentinterleave, "extentinterleave" },
+  {delayalloc, "delayalloc" },
+  {inlinedata, "inlinedata" },
+  {bcstattest, "bcstattest" },
 
   { 0, 0},
 };
@@ -36,3 +36,16 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("shmget");
+entry("shmat");
+entry("shmdt");
+entry("futexwait");
+entry("futexwake");
+entry("clone");
+entry("join");
+entry("spawn");
+entry("fruns");
+entry("blkstat");
+entry("bcstat");